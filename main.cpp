@@ -2,6 +2,7 @@
 #include <cstring>
 #include <cctype>
 #include <cfloat>
+#include <limits>
 #include <cassert>
 #include <cmath>
 #include <iostream>
@@ -20,74 +21,127 @@
 #include <unordered_map>
 #include <memory>
 #include <functional>
+#include <algorithm>
+#include <bit>
 #include <stdexcept>
 #include <variant>
 #include <compare>
-#include "expression.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <optional>
+#include <deque>
+#include <chrono>
+#include <charconv>
+#include <numeric>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "expression.h"  // Only the CExprBuilder interface, formulas are parsed by FormulaParser
 
 using namespace std::literals;
 using CValue = std::variant<std::monostate, double, std::string>;
 
 constexpr unsigned SPREADSHEET_CYCLIC_DEPS = 0x01;
-constexpr unsigned SPREADSHEET_FUNCTIONS = 0;
+constexpr unsigned SPREADSHEET_FUNCTIONS = 0x02;
 constexpr unsigned SPREADSHEET_FILE_IO = 0;
 constexpr unsigned SPREADSHEET_SPEED = 0;
-constexpr unsigned SPREADSHEET_PARSER = 0;
-
-int counter;  // Global counter for cyclic dependency detection
+constexpr unsigned SPREADSHEET_PARSER = 0x10;
 
 class ExprNode;  // Forward declaration
 
+class Bytecode;  // Flat postfix form of an expression
+
 class CPos;  // Position class representing cell positions
 
 class cellContents;  // Class representing the contents of a cell
 
-// Expression builder class for parsing and building expressions
-class MyExprBuilder : public CExprBuilder {
-private:
-    std::stack<std::shared_ptr<ExprNode>> stack;  // Stack for expression nodes
-    const std::map<CPos, std::shared_ptr<cellContents>> &arr;  // Reference to cell contents
-public:
-    MyExprBuilder(const std::map<CPos, std::shared_ptr<cellContents>> &array);
-
-    MyExprBuilder(const MyExprBuilder &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h);
-
-    void opAdd() override;
-
-    void opSub() override;
+struct FormulaTemplate;  // Position-independent formula shared between cells
 
-    void opMul() override;
+class TemplatePool;  // Hash-consed store of formula templates
 
-    void opDiv() override;
+class CellStore;  // Cells of a sheet in fixed-size tiles
 
-    void opPow() override;
+// Bump allocator owning the expression nodes of one spreadsheet. Nodes are never freed
+// one by one: clearing the arena releases every block at once without running destructors,
+// so only trivially destructible objects may live in it. Nodes of overwritten formulas
+// stay allocated until the arena is cleared.
+class NodeArena {
+public:
+    NodeArena() = default;
 
-    void opNeg() override;
+    NodeArena(const NodeArena &) = delete;
 
-    void opEq() override;
+    NodeArena &operator=(const NodeArena &) = delete;
 
-    void opNe() override;
+    template<typename T, typename... Args>
+    T *make(Args &&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are released without destructors");
+        return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
 
-    void opLt() override;
+    template<typename T>
+    T *makeArray(size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are released without destructors");
+        T *ret = static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+        std::uninitialized_value_construct_n(ret, n);
+        return ret;
+    }
 
-    void opLe() override;
+    std::string_view copy(std::string_view str);  // Copies the characters into the arena
 
-    void opGt() override;
+    void clear();  // Releases all nodes at once
 
-    void opGe() override;
+    void reset();  // Releases all nodes but keeps the first block for reuse
 
-    void valNumber(double val) override;
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t firstSize = 0;  // Capacity of blocks[0]
+    char *cur = nullptr;
+    size_t left = 0;  // Free bytes after cur in the newest block
 
-    void valString(std::string val) override;
+    void *allocate(size_t size, size_t align);
+};
 
-    void valReference(std::string val) override;
+void *NodeArena::allocate(size_t size, size_t align) {
+    size_t pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+    if (cur == nullptr || pad + size > left) {
+        // Oversized requests get a block of their own
+        size_t block = std::max(BLOCK_SIZE, size + align);
+        blocks.emplace_back(new char[block]);
+        if (blocks.size() == 1) firstSize = block;
+        cur = blocks.back().get();
+        left = block;
+        pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+    }
+    void *ret = cur + pad;
+    cur += pad + size;
+    left -= pad + size;
+    return ret;
+}
 
-    void valRange(std::string val) override;
+std::string_view NodeArena::copy(std::string_view str) {
+    char *mem = static_cast<char *>(allocate(str.size() + 1, 1));
+    std::memcpy(mem, str.data(), str.size());
+    return {mem, str.size()};
+}
 
-    void funcCall(std::string fnName, int paramCount) override;
+void NodeArena::clear() {
+    blocks.clear();
+    cur = nullptr;
+    left = 0;
+}
 
-    std::shared_ptr<ExprNode> getRoot() const;
-};
+void NodeArena::reset() {
+    if (blocks.empty()) return;
+    blocks.resize(1);
+    cur = blocks[0].get();
+    left = firstSize;
+}
 
 class CPos {
 public:
@@ -95,9 +149,9 @@ public:
 
     CPos(int x, int y);
 
-    CPos(const CPos &other);
+    CPos(const CPos &other) = default;
 
-    ~CPos();
+    ~CPos() = default;
 
     void setColumn(int input);
 
@@ -107,12 +161,16 @@ public:
 
     std::strong_ordering operator<=>(const CPos &other) const;
 
+    bool operator==(const CPos &other) const;
+
     int getColumn() const;
 
     int getRow() const;
 
     std::string getReverseColumn() const;  // Converts column index back to letters
 
+    void appendColumn(std::string &out) const;  // Appends the column letters to out
+
 private:
     int column;
     int row;
@@ -143,10 +201,6 @@ CPos::CPos(std::string_view str) : column(0), row(0) {
 
 CPos::CPos(int x, int y) : column(x), row(y) {}
 
-CPos::CPos(const CPos &other) : column(other.column), row(other.row) {}
-
-CPos::~CPos() = default;
-
 void CPos::setColumn(int input) {
     column = input;
 }
@@ -163,6 +217,10 @@ std::strong_ordering CPos::operator<=>(const CPos &other) const {
     return column <=> other.column;
 }
 
+bool CPos::operator==(const CPos &other) const {
+    return column == other.column && row == other.row;
+}
+
 int CPos::getColumn() const {
     return column;
 }
@@ -172,1087 +230,5315 @@ int CPos::getRow() const {
 }
 
 std::string CPos::getReverseColumn() const {
-    // Converts column number back to letter representation (e.g., 1 -> "A")
-    int tempColumn = column;
     std::string ret;
-    while (tempColumn > 0) {
+    appendColumn(ret);
+    return ret;
+}
+
+void CPos::appendColumn(std::string &out) const {
+    // Converts column number back to letter representation (e.g., 1 -> "A")
+    char letters[8];
+    int count = 0;
+    for (int tempColumn = column; tempColumn > 0 && count < 8;) {
         int rest = (tempColumn - 1) % 26;
         tempColumn = (tempColumn - rest) / 26;
-        ret = char(rest + 'A') + ret;
+        letters[count++] = char(rest + 'A');
     }
-    return ret;
+    while (count) out += letters[--count];
 }
 
-class cellContents {
+// Appends a number as the shortest text that reads back as the same value
+template<typename T>
+void appendNumber(std::string &out, T val) {
+    char buffer[32];
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), val).ptr);
+}
+
+// Expression builder class for parsing and building expressions
+class MyExprBuilder : public CExprBuilder {
+private:
+    std::stack<const ExprNode *> stack;  // Stack for expression nodes
+    NodeArena &arena;  // Storage the nodes are allocated in
+    CPos origin;  // Position of the cell, relative references are stored as offsets from it
+    std::string key;  // Postfix encoding of the relative formula, equal for equal templates
+
+    // Pushes an operator node, or a literal of its value when it reads no cells
+    void push(const ExprNode *node);
+
+    // Leaves only the left operand on the stack if the right one is the number identity and the
+    // left one can only be a number, so the operation would not change it. Commutative operations
+    // check the other way round too.
+    bool dropIdentity(double identity, bool commutative);
 public:
-    bool state;  // True if the cell contains an expression
-    CValue val;  // Value of the cell if not an expression
-    MyExprBuilder expression;  // Expression builder for the cell
+    MyExprBuilder(NodeArena &arena, const CPos &origin);
 
-    cellContents(std::string input, const std::map<CPos, std::shared_ptr<cellContents>> &array);
+    void opAdd() override;
 
-    cellContents(const cellContents &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h);
+    void opSub() override;
 
-    CValue getResult() const;  // Evaluates and returns the cell value
-};
+    void opMul() override;
 
-// Abstract base class for expression nodes
-class ExprNode {
-public:
-    virtual ~ExprNode() = default;
+    void opDiv() override;
 
-    virtual CValue eval() const = 0;  // Evaluates the expression node
+    void opPow() override;
 
-    virtual std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const = 0;
+    void opNeg() override;
 
-    virtual std::string toString(bool top) const = 0;  // Converts the expression to a string
-};
+    void opEq() override;
 
-// Expression node for numbers
-class Number : public ExprNode {
-public:
-    Number(double input) {
-        val = input;
-    }
+    void opNe() override;
 
-    CValue eval() const override {
-        return CValue(val);
-    }
+    void opLt() override;
 
-    Number(const Number &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) {
-        val = other.val;
-    }
+    void opLe() override;
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Number>(*this, array, w, h);
-    }
+    void opGt() override;
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << val;
-        return oss.str();
-    }
+    void opGe() override;
 
-private:
-    double val;
+    void valNumber(double val) override;
+
+    void valString(std::string val) override;
+
+    void valReference(std::string val) override;
+
+    void valRange(std::string val) override;
+
+    void funcCall(std::string fnName, int paramCount) override;
+
+    const ExprNode *getRoot() const;
+
+    const std::string &getKey() const;
 };
 
-// Expression node for strings
-class String : public ExprNode {
-public:
-    explicit String(std::string input) {
-        val = input;
-    }
+// Rectangle of cells between two corners, both included
+struct CRange {
+    CPos from;  // Top left corner
+    CPos to;  // Bottom right corner
 
-    CValue eval() const override {
-        return CValue(val);
+    bool contains(const CPos &pos) const {
+        return pos.getColumn() >= from.getColumn() && pos.getColumn() <= to.getColumn() &&
+               pos.getRow() >= from.getRow() && pos.getRow() <= to.getRow();
     }
 
-    String(const String &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) {
-        val = other.val;
-    }
+    bool operator==(const CRange &other) const = default;
+};
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<String>(*this, array, w, h);
+// Hashes positions and ranges for the unordered containers
+struct PosHash {
+    size_t operator()(const CPos &pos) const {
+        return std::hash<uint64_t>()(uint64_t(uint32_t(pos.getColumn())) << 32 | uint32_t(pos.getRow()));
     }
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        oss << val;
-        return oss.str();
+    size_t operator()(const CRange &range) const {
+        return (*this)(range.from) * 31 + (*this)(range.to);
     }
-
-private:
-    std::string val;
 };
 
-// Expression node for cell references
-class Reference : public ExprNode {
-public:
-    // Parses a cell reference, handling fixed positions with '$'
-    Reference(std::string input, const std::map<CPos, std::shared_ptr<cellContents>> &array) : arr(array) {
-        CPos temp;
-        bool intPresent = false;
-        bool charPresent = false;
-        fixed1 = false;
-        fixed2 = false;
-        if (input.empty()) throw std::invalid_argument("Invalid_Argument");
-
-        for (size_t i = 0; i < input.size(); i++) {
-            input[i] = std::toupper(input[i]);
+// Cells and ranges an expression reads
+struct Precedents {
+    std::vector<CPos> cells;
+    std::vector<CRange> ranges;
+};
 
-            if (input[i] == '$') {
-                if (charPresent == false && i == 0 && fixed1 == false) {
-                    fixed1 = true;
-                } else if ((intPresent == false && fixed2 == false)) {
-                    if (charPresent == false) throw std::invalid_argument("Invalid_Argument");
-                    fixed2 = true;
-                } else throw std::invalid_argument("Invalid_Argument");
+// What an expression needs to evaluate: the cells it reads and the position it is evaluated at
+struct EvalContext {
+    const CellStore &cells;
+    CPos origin;
+};
 
-            } else if (input[i] >= 65 && input[i] <= 90) {
-                charPresent = true;
-                if (intPresent) throw std::invalid_argument("Invalid_Argument");
-                temp.setColumn(temp.getColumn() * 26 + (input[i] - 'A' + 1));
+// Operator semantics shared by the expression tree and the bytecode interpreter
+CValue addValues(const CValue &l, const CValue &r) {
+    // Adds numbers, concatenates as soon as one side is a string
+    if (l == CValue() || r == CValue()) return CValue();
 
-            } else if (input[i] >= 48 && input[i] <= 57) {
-                intPresent = true;
-                if (!charPresent) throw std::invalid_argument("Invalid_Argument");
-                temp.setRow(temp.getRow() * 10 + (input[i] - '0'));
-            } else {
-                throw std::invalid_argument("Invalid_Argument");
-            }
+    if (std::holds_alternative<std::string>(l) || std::holds_alternative<std::string>(r)) {
+        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
+            return std::get<std::string>(l) + std::get<std::string>(r);
+        } else if (std::holds_alternative<std::string>(l)) {
+            return std::get<std::string>(l) + std::to_string(std::get<double>(r));
+        } else {
+            return std::get<std::string>(r) + std::to_string(std::get<double>(l));
         }
-        if (!intPresent) throw std::invalid_argument("Invalid_Argument");
-        position = temp;
     }
+    if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
+        return std::get<double>(l) + std::get<double>(r);
+    }
+    return CValue();
+}
 
-    Reference(const Reference &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) :
-            arr(array), position(other.position), fixed1(other.fixed1), fixed2(other.fixed2)
-    {
-        // Adjusts the position based on fixed flags and offset
-        if ((!fixed1 || !fixed2))
-        {
-            if (!fixed1) {
-                position.setColumn(other.position.getColumn() + w);
-            }
-            if (!fixed2) {
-                position.setRow(other.position.getRow() + h);
-            }
-        }
+CValue subValues(const CValue &l, const CValue &r) {
+    if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
+        return std::get<double>(l) - std::get<double>(r);
     }
+    return CValue();
+}
 
-    CValue eval() const override {
-        // Evaluates the referenced cell's value
-        auto it = arr.find(position);
+CValue mulValues(const CValue &l, const CValue &r) {
+    if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
+        return std::get<double>(l) * std::get<double>(r);
+    }
+    return CValue();
+}
 
-        if (it != arr.end()) {
-            counter++;
-            if (counter > 500) throw std::invalid_argument("Invalid_Argument");
-            return it->second->getResult();
-        }
-        return CValue();
+CValue divValues(const CValue &l, const CValue &r) {
+    if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
+        if (std::get<double>(r) == 0) return CValue();
+        return std::get<double>(l) / std::get<double>(r);
+    }
+    return CValue();
+}
+
+CValue powValues(const CValue &l, const CValue &r) {
+    if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
+        return std::pow(std::get<double>(l), std::get<double>(r));
     }
+    return CValue();
+}
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Reference>(*this, array, w, h);
+CValue negValue(const CValue &s) {
+    if (std::holds_alternative<double>(s)) {
+        return std::get<double>(s) * -1;
     }
+    return CValue();
+}
 
-    std::string toString(bool top) const override {
-        // Converts the reference back to string format
-        std::ostringstream oss;
-        if (top) oss << '=';
-        if (fixed1) oss << "$";
-        oss << position.getReverseColumn();
-        if (fixed2) oss << "$";
-        oss << position.getRow();
-        return oss.str();
+// Compares two numbers or two strings, anything else has no result
+template<typename Compare>
+CValue compareValues(const CValue &l, const CValue &r, Compare cmp) {
+    if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
+        if (cmp(std::get<std::string>(l), std::get<std::string>(r))) return 1.0;
+        return 0.0;
+    }
+    if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
+        if (cmp(std::get<double>(l), std::get<double>(r))) return 1.0;
+        return 0.0;
     }
+    return CValue();
+}
 
-private:
-    const std::map<CPos, std::shared_ptr<cellContents>> &arr;
-    CPos position;
-    bool fixed1, fixed2;
+// Functions formulas can call
+enum class Function : unsigned char {
+    Sum, Avg, Min, Max, Count, CountVal, If,
+    // From here on functions get their arguments evaluated up front, see callOnRanges
+    CountIf, SumIf, AverageIf, VLookup, Match, XLookup
 };
 
-// Expression node for addition
-class Addition : public ExprNode {
-public:
-    Addition(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
-    }
+Function functionByName(std::string name);  // Case-insensitive, throws for unknown names
 
-    Addition(const Addition &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+const char *functionName(Function function);
 
-    CValue eval() const override {
-        // Evaluates addition, handling both numbers and strings
-        CValue l = left->eval();
-        CValue r = right->eval();
+// Arguments a function accepts
+struct Signature {
+    int minArgs, maxArgs;
+    unsigned values;  // Bit i set if argument i must not be a range
+    unsigned ranges;  // Bit i set if argument i must be a range, the others may be either
+};
 
-        if (l == CValue() || r == CValue()) return CValue();
+Signature signature(Function function);
 
-        if (std::holds_alternative<std::string>(l) || std::holds_alternative<std::string>(r)) {
-            if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-                return std::get<std::string>(l) + std::get<std::string>(r);
-            } else if (std::holds_alternative<std::string>(l)) {
-                return std::get<std::string>(l) + std::to_string(std::get<double>(r));
-            } else {
-                return std::get<std::string>(r) + std::to_string(std::get<double>(l));
-            }
-        }
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            return std::get<double>(l) + std::get<double>(r);
-        }
+// How a lookup compares its key with the searched values
+enum class Match : unsigned char {
+    Exact,
+    Below,  // Largest value not above the key
+    Above  // Smallest value not below the key
+};
 
-        return CValue();
-    }
+// Evaluated argument of a function
+struct Argument {
+    bool isRange;
+    CRange range;
+    CValue value;
+};
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Addition>(*this, array, w, h);
-    }
+// Evaluates the conditional aggregates and the lookups
+CValue callOnRanges(Function function, const Argument *args, int count, const CellStore &cells);
 
-    std::string toString(bool top) const override {
-        // Converts addition back to string format
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '+' << right->toString(false) << ')';
-        return oss.str();
-    }
+// Running state of SUM, AVG, MIN, MAX and COUNT over the values of their arguments
+struct Aggregate {
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    size_t numbers = 0;  // Numbers seen
+    size_t values = 0;  // Non-empty values seen, numbers included
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
+    void add(double val);
 
-class Substraction : public ExprNode {
-public:
-    Substraction(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    void add(const CValue &val);
 
-    }
+    void addNumbers(const double *vals, int n);  // Folds a run of adjacent number constants
 
-    Substraction(const Substraction &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    void addRange(const CellStore &cells, const CRange &range);  // Folds the non-empty cells of range
 
-    CValue eval() const override {
+    CValue result(Function function) const;
+};
 
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            return std::get<double>(l) - std::get<double>(r);
-        }
+// Number of cells in range whose value equals target, compared like the = operator
+double countMatches(const CValue &target, const CellStore &cells, const CRange &range);
 
-        return CValue();
+// Opcodes of the formula bytecode, one per kind of expression node
+enum class OpCode : unsigned char {
+    Number, String, Reference, Range, Call,
+    Keep, Load,  // Store the top of the stack in a local and push it again, see Bytecode::shareRepeats
+    Add, Sub, Mul, Div, Pow, Neg, Eq, Ne, Lt, Le, Gt, Ge
+};
 
-    }
+// Cell position as stored in a formula
+struct CellOperand {
+    int column, row;  // Offsets from the evaluated cell unless fixed
+    bool fixedColumn, fixedRow;
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Substraction>(*this, array, w, h);
+    CPos resolve(const CPos &origin) const {
+        return CPos(fixedColumn ? column : origin.getColumn() + column, fixedRow ? row : origin.getRow() + row);
     }
+};
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '-' << right->toString(false) << ')';
-        return oss.str();
+// Range as stored in a formula, its corners may be given in any order
+struct RangeOperand {
+    CellOperand first, second;
+
+    CRange resolve(const CPos &origin) const {
+        CPos l = first.resolve(origin), r = second.resolve(origin);
+        return {CPos(std::min(l.getColumn(), r.getColumn()), std::min(l.getRow(), r.getRow())),
+                CPos(std::max(l.getColumn(), r.getColumn()), std::max(l.getRow(), r.getRow()))};
     }
+};
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
+// Bytecode instruction with its operand stored inline
+struct Instruction {
+    OpCode op;
+    union {
+        double number;  // Constant for OpCode::Number
+        size_t string;  // Index into the string table for OpCode::String
+        size_t range;  // Index into the range table for OpCode::Range
+        CellOperand cell;  // Position read by OpCode::Reference
+        size_t local;  // Index of the local used by OpCode::Keep and OpCode::Load
+        struct {
+            Function function;
+            int count;  // Arguments taken from the stack
+        } call;  // Function applied by OpCode::Call
+    };
 };
 
-class Multiplication : public ExprNode {
+// Postfix program compiled from an expression tree, run on a small value stack
+class Bytecode {
 public:
-    Multiplication(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    void emit(OpCode op);
 
-    }
+    void emitNumber(double val);
 
-    Multiplication(const Multiplication &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w,int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    void emitString(std::string_view val);
 
-    CValue eval() const override {
+    void emitReference(const CellOperand &cell);
 
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
+    void emitRange(const RangeOperand &range);
 
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            return std::get<double>(l) * std::get<double>(r);
-        }
+    void emitCall(Function function, int count);
 
-        return CValue();
+    // Computes every repeated subexpression once: its first occurrence keeps the value in a local,
+    // the later ones are replaced by loading it. Called once the whole expression is emitted.
+    void shareRepeats();
 
-    }
+    CValue run(const EvalContext &ctx) const;  // Interprets the program and returns its result
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Multiplication>(*this, array, w, h);
-    }
+    // Flags runColumn sets for a row: its result is empty, or it read a string and has to run on its own
+    static constexpr unsigned char ROW_BLANK = 1, ROW_MIXED = 2;
+
+    bool numeric() const { return numbersOnly; }  // True if runColumn can run the program
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '*' << right->toString(false) << ')';
-        return oss.str();
+    // Calls onCell for every cell and onRange for every range the program reads at origin
+    template<typename OnCell, typename OnRange>
+    void forEachOperand(const CPos &origin, OnCell onCell, OnRange onRange) const {
+        for (const auto &ins: code) {
+            if (ins.op == OpCode::Reference) onCell(ins.cell.resolve(origin));
+            else if (ins.op == OpCode::Range) onRange(ranges[ins.range].resolve(origin));
+        }
     }
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
+    // Runs a numeric program for the count cells from ctx.origin down, each instruction over a block
+    // of rows at once. Stores the result of row i in results[i] unless flags[i] is set.
+    void runColumn(const EvalContext &ctx, int count, double *results, unsigned char *flags) const;
 
-class Division : public ExprNode {
-public:
-    Division(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+private:
+    // Interpreter stack entry, strings point into the program, a cell or the run's temporaries
+    struct Slot {
+        enum : unsigned char {
+            Empty, Number, Text, Range
+        } kind;
+        double number;
+        union {
+            const std::string *text;
+            const RangeOperand *range;  // Function argument, points into the range table
+        };
+        bool interned = false;  // text is a string constant of the sheet's TemplatePool
+
+        static Slot load(const CValue &val, bool interned = false) {
+            if (auto number = std::get_if<double>(&val)) return {Number, *number, nullptr};
+            if (auto text = std::get_if<std::string>(&val)) return {Text, 0, text, interned};
+            return {Empty, 0, nullptr};
+        }
 
-    }
+        CValue value() const {
+            if (kind == Number) return number;
+            if (kind == Text) return *text;
+            return CValue();
+        }
+    };
 
-    Division(const Division &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    std::vector<Instruction> code;
+    std::vector<std::string> strings;
+    std::vector<RangeOperand> ranges;
+    int depth = 0;  // Stack height after the instructions emitted so far
+    int maxDepth = 0;
+    int locals = 0;  // Values kept by OpCode::Keep
+    bool numbersOnly = true;  // No strings, ranges or calls, so runNumbers can try it first
 
-    CValue eval() const override {
+    void push(const Instruction &ins, int effect);
 
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(r) == 0) return CValue();
-            return std::get<double>(l) / std::get<double>(r);
-        }
+    static int operands(const Instruction &ins);  // Stack entries the instruction consumes
 
-        return CValue();
+    // Reads the operand of a Reference instruction for n rows from row on
+    static void loadColumn(const EvalContext &ctx, const CellOperand &cell, int row, int n, double *values,
+                           unsigned char *flags);
 
+    // Applies op to the rows of two operand columns, leaving the result in the left one
+    template<typename Op>
+    static void combine(double *l, const double *r, int n, Op op) {
+        for (int i = 0; i < n; i++) l[i] = op(l[i], r[i]);
     }
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Division>(*this, array, w, h);
-    }
+    // Runs a numbersOnly program on plain doubles. Returns false, leaving the program to the
+    // generic interpreter, once a referenced cell holds a string.
+    bool runNumbers(const EvalContext &ctx, CValue &result) const;
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '/' << right->toString(false) << ')';
-        return oss.str();
-    }
+    template<typename T>
+    static bool compare(OpCode op, const T &l, const T &r);
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
+    static void mixed(OpCode op, Slot &l, const Slot &r, std::list<std::string> &temps);
+
+    static Slot call(Function function, const Slot *args, int count, const EvalContext &ctx,
+                     std::list<std::string> &temps);
 };
 
-class Power : public ExprNode {
+class cellContents {
 public:
-    Power(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    bool state;  // True if the cell contains an expression
+    CValue val;  // Value of the cell if it is a number constant, empty for the other constants
+    const CValue *text = nullptr;  // Value of a string constant, interned in the sheet's TemplatePool
+    // Relative form of the expression, shared with equal formulas. Null while a lazily loaded formula
+    // is unparsed, and for good if its text turns out not to parse, the cell then reads as empty.
+    const FormulaTemplate *formula = nullptr;
+    std::string_view source;  // Text of a lazily loaded formula, empty once it is parsed
+    CPos pos;  // Position of the cell, the formula's relative references start here
+    mutable CValue cache;  // Last computed value of the expression
+    mutable std::atomic<bool> dirty = true;  // True if cache no longer matches the expression
+    mutable std::atomic<bool> busy = false;  // True while a thread evaluates the expression into cache
+    bool cyclic = false;  // True if the cell lies on a reference cycle or reads a cell that does
 
-    }
+    cellContents(const std::string &input, const CPos &pos, TemplatePool &templates, NodeArena &scratch);
 
-    Power(const Power &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    cellContents(const cellContents &other, const CPos &pos);  // The same contents placed at pos
 
-    CValue eval() const override {
+    cellContents(CValue val, const CPos &pos) : state(false), val(std::move(val)), pos(pos) {}  // A number or empty
 
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            return std::pow(std::get<double>(l), std::get<double>(r));
-        }
+    cellContents(const CValue *text, const CPos &pos) : state(false), text(text), pos(pos) {}  // An interned string
 
-        return CValue();
+    cellContents(const FormulaTemplate *formula, const CPos &pos) : state(true), formula(formula), pos(pos) {}
 
-    }
+    cellContents(std::string_view source, const CPos &pos) : state(true), source(source), pos(pos) {}  // Unparsed
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '^' << right->toString(false) << ')';
-        return oss.str();
-    }
+    CValue getResult(const CellStore &cells) const;  // Evaluates and returns the cell value
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Power>(*this, array, w, h);
-    }
+    const CValue &value(const CellStore &cells) const;  // Same as getResult, without copying the value
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
+    // Stores a result computed for the expression elsewhere, unless a reader is evaluating the cell itself
+    void store(CValue result) const;
 
+    const CValue &constant() const { return text ? *text : val; }  // Value of a cell that is not an expression
+
+    Precedents references() const;  // Cells and ranges the cell's expression reads
+
+    // A lazily loaded formula whose text did not parse, it reads as empty and is not saved
+    bool broken() const { return state && formula == nullptr && source.empty(); }
 };
 
-class Negation : public ExprNode {
+// Segment tree over the 64-row blocks of one column. Each leaf summarizes the number constants of
+// its block and counts its strings and formulas, so a range over many blocks is folded in O(log n)
+// and the formulas inside it are found without visiting the blocks that hold none.
+class ColumnIndex {
 public:
-    Negation(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        single = std::move(stack.top());
-        stack.pop();
+    static constexpr int BLOCK_BITS = 6;
+    static constexpr int MAX_BLOCKS = 1 << 16;  // Rows from 4M on are not indexed
+
+    struct Node {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        uint32_t numbers = 0;  // Number constants below the node
+        uint32_t texts = 0;  // String constants below the node
+        uint32_t formulas = 0;  // Formulas below the node
+    };
+
+    void set(int block, const Node &leaf);  // Replaces the summary of a block, growing the tree if needed
+
+    bool empty() const {
+        return tree.empty() || (tree[1].numbers == 0 && tree[1].texts == 0 && tree[1].formulas == 0);
+    }
 
+    void fold(int block0, int block1, Aggregate &aggregate) const;  // Adds the numbers of blocks [block0, block1)
 
+    // Calls fn with every block in [block0, block1) holding a formula
+    template<typename Fn>
+    void forEachFormulaBlock(int block0, int block1, Fn fn) const {
+        block1 = std::min(block1, size);
+        if (block0 < block1) formulasIn(1, 0, size, block0, block1, fn);
     }
 
-    Negation(const Negation &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : single(other.single->clone(array, w, h)) {}
+private:
+    std::vector<Node> tree;  // Heap order, the leaves start at index size
+    int size = 0;  // Number of leaves, a power of two
 
+    static Node combine(const Node &l, const Node &r) {
+        return {l.sum + r.sum, std::min(l.min, r.min), std::max(l.max, r.max), l.numbers + r.numbers,
+                l.texts + r.texts, l.formulas + r.formulas};
+    }
 
-    CValue eval() const override {
-        CValue s = single->eval();
-        if (s == CValue()) return CValue();
-        if (std::holds_alternative<double>(s)) {
-            return std::get<double>(s) * -1;
+    template<typename Fn>
+    void formulasIn(int node, int lo, int hi, int block0, int block1, Fn &fn) const {
+        if (tree[node].formulas == 0 || hi <= block0 || block1 <= lo) return;
+        if (node >= size) {
+            fn(lo);
+            return;
         }
-        return CValue();
+        int mid = (lo + hi) / 2;
+        formulasIn(node * 2, lo, mid, block0, block1, fn);
+        formulasIn(node * 2 + 1, mid, hi, block0, block1, fn);
     }
+};
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Negation>(*this, array, w, h);
+void ColumnIndex::set(int block, const Node &leaf) {
+    if (block >= size) {
+        int grown = std::max(size, 1);
+        while (grown <= block) grown *= 2;
+        std::vector<Node> next(2 * grown);
+        for (int i = 0; i < size; i++) next[grown + i] = tree[size + i];
+        for (int i = grown - 1; i > 0; i--) next[i] = combine(next[2 * i], next[2 * i + 1]);
+        tree = std::move(next);
+        size = grown;
     }
+    int node = size + block;
+    tree[node] = leaf;
+    for (node /= 2; node > 0; node /= 2) tree[node] = combine(tree[2 * node], tree[2 * node + 1]);
+}
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << '-' << single->toString(false) << ')';
-        return oss.str();
+void ColumnIndex::fold(int block0, int block1, Aggregate &aggregate) const {
+    Node total;
+    int l = size + block0, r = size + std::min(block1, size);
+    for (; l < r; l /= 2, r /= 2) {
+        if (l & 1) total = combine(total, tree[l++]);
+        if (r & 1) total = combine(total, tree[--r]);
     }
+    aggregate.sum += total.sum;
+    aggregate.min = std::min(aggregate.min, total.min);
+    aggregate.max = std::max(aggregate.max, total.max);
+    aggregate.numbers += total.numbers;
+    aggregate.values += total.numbers + total.texts;
+}
 
+// True if val satisfies a lookup of key
+bool matchesKey(const CValue &val, const CValue &key, Match match) {
+    switch (match) {
+        case Match::Exact: return compareValues(val, key, std::equal_to<>()) == CValue(1.0);
+        case Match::Below: return compareValues(val, key, std::less_equal<>()) == CValue(1.0);
+        default: return compareValues(val, key, std::greater_equal<>()) == CValue(1.0);
+    }
+}
 
-private:
-    std::shared_ptr<ExprNode> single;
-};
+// True if a match of val at pos beats the match of best at bestPos, both satisfying the lookup
+bool betterMatch(const CValue &val, int pos, const CValue &best, int bestPos, Match match, bool last) {
+    if (match == Match::Below && compareValues(val, best, std::not_equal_to<>()) == CValue(1.0)) {
+        return compareValues(val, best, std::greater<>()) == CValue(1.0);
+    }
+    if (match == Match::Above && compareValues(val, best, std::not_equal_to<>()) == CValue(1.0)) {
+        return compareValues(val, best, std::less<>()) == CValue(1.0);
+    }
+    return last ? pos > bestPos : pos < bestPos;
+}
 
-class Equal : public ExprNode {
+// Values of one column for the lookup functions: a hash index answers exact matches and a tree of
+// row blocks answers nearest matches inside a window of rows. A formula cell joins the index with
+// its value the first time a lookup covers it and leaves it again once it is marked dirty, so
+// lookups only evaluate the formulas changed since the last one.
+class LookupIndex {
 public:
-    Equal(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    void add(const cellContents &cell);
 
+    void remove(const cellContents &cell);
+
+    void invalidate(int row);  // The formula at row is dirty, its value leaves the index
+
+    void invalidateAll();  // Every formula is dirty
+
+    // Row in [row0, row1] whose value matches key, the first one or the last one if last is set.
+    // valueAt(row) gives the current value of a formula cell.
+    template<typename ValueAt>
+    std::optional<int> find(const CValue &key, Match match, int row0, int row1, bool last, ValueAt valueAt) const {
+        auto number = std::get_if<double>(&key);
+        auto text = std::get_if<std::string>(&key);
+        std::vector<int> rows;
+        bool order;
+        {
+            std::shared_lock<std::shared_mutex> guard(lock);
+            for (auto row = stale.lower_bound(row0); row != stale.end() && *row <= row1; ++row) rows.push_back(*row);
+            order = match != Match::Exact && (number ? !numbers.ordered : text && !texts.ordered);
+        }
+        if (!rows.empty() || order) {
+            // Evaluated without holding the lock, a formula may look up this column itself
+            std::vector<CValue> values;
+            values.reserve(rows.size());
+            for (int row: rows) values.push_back(valueAt(row));
+            std::unique_lock<std::shared_mutex> guard(lock);
+            for (size_t i = 0; i < rows.size(); i++) {
+                // Another lookup may have added the row meanwhile
+                if (!stale.erase(rows[i])) continue;
+                addValue(values[i], rows[i]);
+                evaluated.emplace(rows[i], std::move(values[i]));
+            }
+            if (order && number) numbers.order();
+            else if (order) texts.order();
+        }
+        std::shared_lock<std::shared_mutex> guard(lock);
+        if (number) return numbers.find(*number, match, row0, row1, last);
+        if (text) return texts.find(*text, match, row0, row1, last);
+        return std::nullopt;
     }
 
-    Equal(const Equal &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+private:
+    // Values of one type. Level l of the tree splits the rows into blocks of 8^l and counts the
+    // values in each block in order. Levels are added until the top one has at most 8 blocks, so a
+    // window is covered by O(log n) blocks, each answering its nearest value in O(log n). Exact
+    // matches only need the hash index, the tree is built by the first nearest match.
+    template<typename T>
+    struct Values {
+        static constexpr int FAN_BITS = 3;
+        static constexpr size_t FAN = 1 << FAN_BITS;
+
+        // Orders pointers to the keys of rows by the values they point to
+        struct Less {
+            using is_transparent = void;
+
+            bool operator()(const T *l, const T *r) const { return *l < *r; }
+
+            bool operator()(const T *l, const T &r) const { return *l < r; }
+
+            bool operator()(const T &l, const T *r) const { return l < *r; }
+        };
+
+        using Block = std::map<const T *, int, Less>;  // Count of each value
+
+        std::unordered_map<T, std::set<int>> rows;  // Rows holding each value
+        std::unordered_map<int, const T *> at;  // Value of each row, the key in rows
+        std::vector<std::unordered_map<int64_t, Block>> levels;  // Blocks of levels 1 and up by index
+        bool ordered = false;  // True once levels are kept
+
+        void add(const T &val, int row) {
+            auto set = rows.try_emplace(val).first;
+            set->second.insert(row);
+            at.emplace(row, &set->first);
+            for (size_t level = 1; level <= levels.size(); level++) {
+                levels[level - 1][int64_t(row) >> (FAN_BITS * level)][&set->first]++;
+            }
+            if (ordered) grow();
+        }
+
+        void order() {
+            if (ordered) return;
+            ordered = true;
+            grow();
+        }
 
+        // Adds levels while the top one has too many blocks
+        void grow() {
+            while ((levels.empty() ? at.size() : levels.back().size()) > FAN) {
+                std::unordered_map<int64_t, Block> parents;
+                if (levels.empty()) {
+                    for (const auto &[row, key]: at) parents[int64_t(row) >> FAN_BITS][key]++;
+                } else {
+                    for (const auto &[index, block]: levels.back()) {
+                        Block &parent = parents[index >> FAN_BITS];
+                        for (const auto &[key, count]: block) parent[key] += count;
+                    }
+                }
+                levels.push_back(std::move(parents));
+            }
+        }
 
-    CValue eval() const override {
+        void remove(const T &val, int row) {
+            auto set = rows.find(val);
+            for (size_t level = 1; level <= levels.size(); level++) {
+                auto block = levels[level - 1].find(int64_t(row) >> (FAN_BITS * level));
+                auto count = block->second.find(&set->first);
+                if (--count->second == 0) block->second.erase(count);
+                if (block->second.empty()) levels[level - 1].erase(block);
+            }
+            at.erase(row);
+            set->second.erase(row);
+            if (set->second.empty()) rows.erase(set);
+        }
 
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-            if (std::get<std::string>(l) == std::get<std::string>(r)) return 1.0;
-            return 0.0;
+        // First or last row of set inside [row0, row1]
+        static std::optional<int> pick(const std::set<int> &set, int row0, int row1, bool last) {
+            auto it = last ? set.upper_bound(row1) : set.lower_bound(row0);
+            if (last) {
+                if (it == set.begin() || *--it < row0) return std::nullopt;
+            } else if (it == set.end() || *it > row1) return std::nullopt;
+            return *it;
         }
 
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(l) == std::get<double>(r)) return 1.0;
-            return 0.0;
+        std::optional<int> find(const T &key, Match match, int row0, int row1, bool last) const {
+            if (match == Match::Exact) {
+                auto set = rows.find(key);
+                if (set == rows.end()) return std::nullopt;
+                return pick(set->second, row0, row1, last);
+            }
+            const T *best = nullptr;
+            auto consider = [&](const T *val) {
+                if (match == Match::Below ? *val > key : *val < key) return;
+                if (!best || (match == Match::Below ? *val > *best : *val < *best)) best = val;
+            };
+            if (levels.empty()) {
+                for (const auto &[row, val]: at) {
+                    if (row >= row0 && row <= row1) consider(val);
+                }
+            } else {
+                // The nearest value of the whole column answers most lookups, the window is only
+                // walked if that value has no row inside it
+                for (const auto &top: levels.back()) {
+                    nearest(levels.size(), top.first, key, match, std::numeric_limits<int>::min(),
+                            std::numeric_limits<int>::max(), consider);
+                }
+                if (!best) return std::nullopt;
+                if (auto row = pick(rows.find(*best)->second, row0, row1, last)) return row;
+                best = nullptr;
+                for (const auto &top: levels.back()) nearest(levels.size(), top.first, key, match, row0, row1, consider);
+            }
+            if (!best) return std::nullopt;
+            return pick(rows.find(*best)->second, row0, row1, last);
+        }
 
+        // Hands consider the nearest value to key of each block under block index of level that
+        // lies wholly inside [row0, row1], and the values of the rows at its edges
+        template<typename Consider>
+        void nearest(size_t level, int64_t index, const T &key, Match match, int row0, int row1,
+                     Consider &consider) const {
+            int64_t first = index << (FAN_BITS * level), end = (index + 1) << (FAN_BITS * level);
+            if (end <= row0 || first > row1) return;
+            if (level == 0) {
+                auto val = at.find(int(index));
+                if (val != at.end()) consider(val->second);
+                return;
+            }
+            auto block = levels[level - 1].find(index);
+            if (block == levels[level - 1].end()) return;
+            if (first >= row0 && end - 1 <= row1) {
+                if (match == Match::Below) {
+                    auto it = block->second.upper_bound(key);
+                    if (it != block->second.begin()) consider((--it)->first);
+                } else {
+                    auto it = block->second.lower_bound(key);
+                    if (it != block->second.end()) consider(it->first);
+                }
+                return;
+            }
+            for (size_t child = 0; child < FAN; child++) {
+                nearest(level - 1, index * int64_t(FAN) + int64_t(child), key, match, row0, row1, consider);
+            }
         }
+    };
 
-        return CValue();
+    // Lookups running in parallel add formula values under lock, everything else changes along
+    // with the cells
+    mutable Values<double> numbers;
+    mutable Values<std::string> texts;
+    mutable std::set<int> stale;  // Formula rows whose value is not in the index
+    mutable std::unordered_map<int, CValue> evaluated;  // Values of the other formula rows
+    mutable std::shared_mutex lock;
 
-    }
+    void addValue(const CValue &val, int row) const;
+
+    void removeValue(const CValue &val, int row) const;
+};
+
+void LookupIndex::add(const cellContents &cell) {
+    int row = cell.pos.getRow();
+    if (cell.state) stale.insert(row);
+    else if (cell.text) addValue(*cell.text, row);
+    else addValue(cell.val, row);
+}
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<Equal>(*this, array, w, h);
+void LookupIndex::remove(const cellContents &cell) {
+    int row = cell.pos.getRow();
+    if (cell.state) {
+        if (stale.erase(row)) return;
+        auto val = evaluated.find(row);
+        removeValue(val->second, row);
+        evaluated.erase(val);
+    } else if (cell.text) {
+        removeValue(*cell.text, row);
+    } else {
+        removeValue(cell.val, row);
     }
+}
+
+void LookupIndex::invalidate(int row) {
+    auto val = evaluated.find(row);
+    if (val == evaluated.end()) return;  // A constant, or a formula no lookup has read yet
+    removeValue(val->second, row);
+    evaluated.erase(val);
+    stale.insert(row);
+}
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '=' << right->toString(false) << ')';
-        return oss.str();
+void LookupIndex::invalidateAll() {
+    for (const auto &[row, val]: evaluated) {
+        removeValue(val, row);
+        stale.insert(row);
     }
+    evaluated.clear();
+}
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
+void LookupIndex::addValue(const CValue &val, int row) const {
+    if (auto text = std::get_if<std::string>(&val)) texts.add(*text, row);
+    else if (auto number = std::get_if<double>(&val); number && !std::isnan(*number)) numbers.add(*number, row);
+}
 
-class NotEqual : public ExprNode {
+void LookupIndex::removeValue(const CValue &val, int row) const {
+    if (auto text = std::get_if<std::string>(&val)) texts.remove(*text, row);
+    else if (auto number = std::get_if<double>(&val); number && !std::isnan(*number)) numbers.remove(*number, row);
+}
+
+// Hash directory of shards shared between copies of a sheet. Copying it only copies a pointer; the
+// first write to either copy clones the directory, which holds pointers, and writing a shard
+// clones that shard alone while another copy still holds it.
+template<typename Key, typename Shard>
+class SharedShards {
 public:
-    NotEqual(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = stack.top();
-        stack.pop();
-        left = stack.top();
-        stack.pop();
+    using Directory = std::unordered_map<Key, std::shared_ptr<Shard>>;
 
-    }
+    SharedShards() = default;
 
-    NotEqual(const NotEqual &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    SharedShards(const SharedShards &other) = default;  // Moving copies too, a directory is never null
 
-    CValue eval() const override {
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-            if (std::get<std::string>(l) == std::get<std::string>(r)) return 0.0;
-            return 1.0;
-        }
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(l) == std::get<double>(r)) return 0.0;
-            return 1.0;
+    SharedShards &operator=(const SharedShards &other) = default;
 
-        }
-        return CValue();
+    const Shard *find(const Key &key) const {
+        auto shard = directory->find(key);
+        return shard == directory->end() ? nullptr : shard->second.get();
     }
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<NotEqual>(*this, array, w, h);
+    // The shard at key for writing, created empty if it is missing
+    Shard &modify(const Key &key) {
+        auto &shard = own()[key];
+        if (!shard) shard = std::make_shared<Shard>();
+        else if (shard.use_count() > 1) shard = std::make_shared<Shard>(*shard);
+        return *shard;
     }
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << "<>" << right->toString(false) << ')';
-        return oss.str();
-    }
+    void erase(const Key &key) { own().erase(key); }
+
+    void clear() { directory = std::make_shared<Directory>(); }
+
+    size_t size() const { return directory->size(); }
 
+    // Iterates the (key, shard pointer) pairs
+    typename Directory::const_iterator begin() const { return directory->begin(); }
+
+    typename Directory::const_iterator end() const { return directory->end(); }
 
 private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
+    std::shared_ptr<Directory> directory = std::make_shared<Directory>();
+
+    Directory &own() {
+        if (directory.use_count() > 1) directory = std::make_shared<Directory>(*directory);
+        return *directory;
+    }
 };
 
-class LessThan : public ExprNode {
+// Cells of a sheet in 64x64 tiles found through a hash directory keyed by tile coordinates,
+// so a lookup is one hash probe and an index into the tile. Slots are stored column by column,
+// a column scan inside a tile walks contiguous memory and a row scan a fixed stride. Every tile
+// column keeps bitmaps of its occupied rows and of the rows holding a number constant, whose
+// values are mirrored in a dense array so aggregates can run over them without touching the cells.
+// A ColumnIndex per column summarizes the tiles of that column for ranges spanning many blocks.
+// Copies share the tiles, the column indexes and the cells themselves until one of them writes.
+class CellStore {
 public:
-    LessThan(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
 
-    }
+    CellStore() = default;
 
-    LessThan(const LessThan &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    CellStore(const CellStore &other) : tiles(other.tiles), columns(other.columns), count(other.count) {}
 
+    CellStore(CellStore &&other) noexcept;
 
-    CValue eval() const override {
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-            if (std::get<std::string>(l) < std::get<std::string>(r)) return 1.0;
-            return 0.0;
-        }
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(l) < std::get<double>(r)) return 1.0;
-            return 0.0;
+    CellStore &operator=(const CellStore &other);
 
-        }
-        return CValue();
-    }
+    CellStore &operator=(CellStore &&other) noexcept;
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<LessThan>(*this, array, w, h);
-    }
+    const cellContents *find(const CPos &pos) const;  // Cell at pos, nullptr if empty
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '<' << right->toString(false) << ')';
-        return oss.str();
-    }
+    // Cell at pos for changing its flags, cloned first if a copy of the store shares it
+    cellContents *own(const CPos &pos);
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
+    // Marks the cell at pos dirty, a lookup index then reads the new value of a formula there
+    void invalidate(const CPos &pos);
 
-class LessEqual : public ExprNode {
-public:
-    LessEqual(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    void invalidateLookups();  // Lets the lookup indexes read every formula again after all turned dirty
 
-    }
+    void put(const CPos &pos, std::unique_ptr<cellContents> cell);  // Stores cell at pos, erases it for nullptr
 
-    LessEqual(const LessEqual &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
+    void clear();
 
-    CValue eval() const override {
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-            if (std::get<std::string>(l) <= std::get<std::string>(r)) return 1.0;
-            return 0.0;
-        }
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(l) <= std::get<double>(r)) return 1.0;
-            return 0.0;
+    size_t size() const { return count; }
 
-        }
-        return CValue();
+    // Calls fn on every cell, tile by tile in position order so the walk is deterministic
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        forEachTile([&](const Tile &tile) {
+            forEachBit(tile.columns, [&](int col) {
+                forEachBit(tile.occupied[col], [&](int row) { fn(std::as_const(*tile.cells[col * TILE_SIZE + row])); });
+            });
+        });
     }
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<LessEqual>(*this, array, w, h);
+    // Calls fn on every formula cell in forEach order, the number constants are skipped unread
+    template<typename Fn>
+    void forEachFormula(Fn fn) const {
+        forEachTile([&](const Tile &tile) {
+            forEachBit(tile.columns, [&](int col) {
+                forEachBit(tile.occupied[col] & ~tile.numeric[col], [&](int row) {
+                    const cellContents &cell = *tile.cells[col * TILE_SIZE + row];
+                    if (cell.state) fn(cell);
+                });
+            });
+        });
     }
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << "<=" << right->toString(false) << ')';
-        return oss.str();
+    // Calls fn on every cell like forEach, handing out cells owned by this store as own does
+    template<typename Fn>
+    void forEachOwned(Fn fn) {
+        forEach([&](const cellContents &cell) { fn(*own(cell.pos)); });
     }
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
-
-class GreaterThan : public ExprNode {
-public:
-    GreaterThan(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
-
+    // Key of the tile holding pos, shards keyed by it group the positions of a tile
+    static uint64_t tileKey(const CPos &pos) {
+        return tileKey(pos.getColumn() >> TILE_BITS, pos.getRow() >> TILE_BITS);
     }
 
-    GreaterThan(const GreaterThan &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
-
+    // Calls fn on every cell with a column in [col0, col1) and a row in [row0, row1)
+    template<typename Fn>
+    void forEachIn(int col0, int row0, int col1, int row1, Fn fn) const {
+        forTilesIn(col0, row0, col1, row1, [&](const Tile &tile, int col, uint64_t rows) {
+            forEachBit(tile.occupied[col] & rows, [&](int row) { fn(std::as_const(*tile.cells[col * TILE_SIZE + row])); });
+        });
+    }
 
-    CValue eval() const override {
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-            if (std::get<std::string>(l) > std::get<std::string>(r)) return 1.0;
-            return 0.0;
-        }
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(l) > std::get<double>(r)) return 1.0;
-            return 0.0;
+    // Walks the rectangle like forEachIn, but hands each run of adjacent number constants in a
+    // column to numbers(const double *values, int n) and only the remaining cells to other
+    template<typename Numbers, typename Other>
+    void scanIn(int col0, int row0, int col1, int row1, Numbers numbers, Other other) const {
+        forTilesIn(col0, row0, col1, row1, [&](const Tile &tile, int col, uint64_t rows) {
+            uint64_t run = tile.numeric[col] & rows;
+            const double *values = &tile.numbers[col * TILE_SIZE];
+            while (run) {
+                int start = std::countr_zero(run);
+                int length = std::countr_one(run >> start);
+                numbers(values + start, length);
+                run &= length + start == 64 ? 0 : ~uint64_t(0) << (start + length);
+            }
+            forEachBit(tile.occupied[col] & ~tile.numeric[col] & rows,
+                       [&](int row) { other(std::as_const(*tile.cells[col * TILE_SIZE + row])); });
+        });
+    }
 
+    // Copies the values of the number constants in column col and rows [row, row + n) to values,
+    // tile by tile, and hands every other row i to other(i, cell), with a null cell if it is empty
+    template<typename Other>
+    void loadColumn(int col, int row, int n, double *values, Other other) const {
+        for (int i = 0; i < n;) {
+            CPos pos(col, row + i);
+            int offset = pos.getRow() & (TILE_SIZE - 1), length = std::min(n - i, TILE_SIZE - offset);
+            if (const Tile *tile = tiles.find(tileKey(pos))) {
+                std::copy_n(&tile->numbers[slot(pos)], length, values + i);
+                forEachBit(~tile->numeric[col & (TILE_SIZE - 1)] & span(offset, offset + length), [&](int bit) {
+                    other(i + bit - offset, tile->cells[slot(pos) + bit - offset].get());
+                });
+            } else {
+                for (int k = 0; k < length; k++) other(i + k, nullptr);
+            }
+            i += length;
         }
-        return CValue();
     }
 
-
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<GreaterThan>(*this, array, w, h);
+    // Adds the non-empty cells of the rectangle to aggregate: constants in whole blocks come from
+    // the column indexes, the rest of the numbers from the tiles, and the remaining cells go to
+    // other, which gets every formula and the strings outside whole blocks
+    template<typename Other>
+    void foldIn(int col0, int row0, int col1, int row1, Aggregate &aggregate, Other other) const {
+        indexedScan(col0, row0, col1, row1, &aggregate, other);
     }
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << '>' << right->toString(false) << ')';
-        return oss.str();
+    // Calls fn on every formula cell of the rectangle
+    template<typename Fn>
+    void forEachFormulaIn(int col0, int row0, int col1, int row1, Fn fn) const {
+        auto formulas = [&](const cellContents &cell) {
+            if (cell.state) fn(cell);
+        };
+        indexedScan(col0, row0, col1, row1, nullptr, formulas);
     }
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
-
-class GreaterEqual : public ExprNode {
-public:
-    GreaterEqual(std::stack<std::shared_ptr<ExprNode>> &stack) {
-        right = std::move(stack.top());
-        stack.pop();
-        left = std::move(stack.top());
-        stack.pop();
+    // Row of the cell in column col and rows [row0, row1] whose value matches key, the first such
+    // row or the last one if last is set. The column's lookup index is built on first use.
+    std::optional<int> lookup(int col, int row0, int row1, const CValue &key, Match match, bool last) const;
 
+private:
+    static_assert(ColumnIndex::BLOCK_BITS == TILE_BITS, "index blocks are the rows of a tile");
+    static constexpr int64_t INDEXED_ROWS = int64_t(ColumnIndex::MAX_BLOCKS) << TILE_BITS;
+
+    struct Tile {
+        std::array<std::shared_ptr<cellContents>, TILE_SIZE * TILE_SIZE> cells;
+        std::array<double, TILE_SIZE * TILE_SIZE> numbers;  // Values of the number constants
+        std::array<uint64_t, TILE_SIZE> occupied{};  // Bit per row of each column with a cell
+        std::array<uint64_t, TILE_SIZE> numeric{};  // Bit per row of each column with a number constant
+        uint64_t columns = 0;  // Bit per column with any cell
+        int used = 0;  // Occupied slots, the tile is dropped when it reaches zero
+    };
+
+    SharedShards<uint64_t, Tile> tiles;
+    SharedShards<int, ColumnIndex> columns;  // Indexes of the columns with cells in indexed rows
+    mutable std::unordered_map<int, std::unique_ptr<LookupIndex>> lookups;  // Columns searched by lookups so far
+    mutable std::shared_mutex lookupsLock;  // Lookups running in parallel may build indexes
+    size_t count = 0;
+
+    static uint64_t tileKey(int64_t tileCol, int64_t tileRow) {
+        return uint64_t(uint32_t(tileCol)) << 32 | uint32_t(tileRow);
     }
 
-    GreaterEqual(const GreaterEqual &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-            : left(other.left->clone(array, w, h)), right(other.right->clone(array, w, h)) {}
-
-
-    CValue eval() const override {
-        CValue l = left->eval();
-        CValue r = right->eval();
-        if (l == CValue() || r == CValue()) return CValue();
-        if (std::holds_alternative<std::string>(l) && std::holds_alternative<std::string>(r)) {
-            if (std::get<std::string>(l) >= std::get<std::string>(r)) return 1.0;
-            return 0.0;
+    template<typename Other>
+    void indexedScan(int col0, int row0, int col1, int row1, Aggregate *aggregate, Other &other) const {
+        auto numbers = [&](const double *vals, int n) {
+            if (aggregate) aggregate->addNumbers(vals, n);
+        };
+        if (row0 < 0 || row1 > INDEXED_ROWS) {
+            scanIn(col0, row0, col1, row1, numbers, other);
+            return;
         }
-        if (std::holds_alternative<double>(l) && std::holds_alternative<double>(r)) {
-            if (std::get<double>(l) >= std::get<double>(r)) return 1.0;
-            return 0.0;
-
+        auto column = [&](int col, const ColumnIndex &index) {
+            int block0 = (row0 + TILE_SIZE - 1) >> TILE_BITS, block1 = row1 >> TILE_BITS;
+            if (block0 >= block1) {
+                scanIn(col, row0, col + 1, row1, numbers, other);
+                return;
+            }
+            // Partial blocks at both ends come from the tiles, the whole blocks between from the index
+            scanIn(col, row0, col + 1, block0 << TILE_BITS, numbers, other);
+            scanIn(col, block1 << TILE_BITS, col + 1, row1, numbers, other);
+            if (aggregate) index.fold(block0, block1, *aggregate);
+            index.forEachFormulaBlock(block0, block1, [&](int block) {
+                const Tile &tile = *tiles.find(tileKey(col >> TILE_BITS, block));
+                int slot = col & (TILE_SIZE - 1);
+                forEachBit(tile.occupied[slot] & ~tile.numeric[slot], [&](int row) {
+                    const cellContents &cell = *tile.cells[slot * TILE_SIZE + row];
+                    if (cell.state) other(cell);
+                });
+            });
+        };
+        if (int64_t(col1) - col0 <= int64_t(columns.size())) {
+            for (int col = col0; col < col1; col++) {
+                if (const ColumnIndex *index = columns.find(col)) column(col, *index);
+            }
+            return;
+        }
+        for (const auto &index: columns) {
+            if (index.first >= col0 && index.first < col1) column(index.first, *index.second);
         }
-        return CValue();
     }
 
-    std::shared_ptr<ExprNode>
-    clone(const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h) const override {
-        return std::make_shared<GreaterEqual>(*this, array, w, h);
+    static int slot(const CPos &pos) {
+        return (pos.getColumn() & (TILE_SIZE - 1)) * TILE_SIZE + (pos.getRow() & (TILE_SIZE - 1));
     }
 
-    std::string toString(bool top) const override {
-        std::ostringstream oss;
-        if (top) oss << '=';
-        oss << '(' << left->toString(false) << ">=" << right->toString(false) << ')';
-        return oss.str();
+    // Calls fn on every tile in position order
+    template<typename Fn>
+    void forEachTile(Fn fn) const {
+        std::vector<uint64_t> keys;
+        keys.reserve(tiles.size());
+        for (const auto &tile: tiles) keys.push_back(tile.first);
+        std::sort(keys.begin(), keys.end(), [](uint64_t l, uint64_t r) {
+            return std::pair(int32_t(l >> 32), int32_t(l)) < std::pair(int32_t(r >> 32), int32_t(r));
+        });
+        for (uint64_t key: keys) fn(*tiles.find(key));
     }
 
-private:
-    std::shared_ptr<ExprNode> left;
-    std::shared_ptr<ExprNode> right;
-};
-
+    // Mask of the bits in [from, to) clamped to one tile
+    static uint64_t span(int64_t from, int64_t to) {
+        from = std::max<int64_t>(from, 0);
+        to = std::min<int64_t>(to, TILE_SIZE);
+        if (from >= to) return 0;
+        return (to == 64 ? ~uint64_t(0) : (uint64_t(1) << to) - 1) & (~uint64_t(0) << from);
+    }
 
-MyExprBuilder::MyExprBuilder(const std::map<CPos, std::shared_ptr<cellContents>> &array) : arr(array) {}
+    template<typename Fn>
+    static void forEachBit(uint64_t bits, Fn fn) {
+        while (bits) {
+            fn(std::countr_zero(bits));
+            bits &= bits - 1;
+        }
+    }
 
-MyExprBuilder::MyExprBuilder(const MyExprBuilder &other, const std::map<CPos, std::shared_ptr<cellContents>> &array,
-                             int w, int h)
-        : arr(array) {
-    if (!other.stack.empty()) {
-        stack.push(other.stack.top()->clone(arr, w, h));
+    // Calls fn(tile, column in tile, mask of rows) for every tile column overlapping the rectangle.
+    // Visits the tiles the rectangle covers, or the directory when it holds fewer tiles than that.
+    template<typename Fn>
+    void forTilesIn(int col0, int row0, int col1, int row1, Fn fn) const {
+        if (col0 >= col1 || row0 >= row1) return;
+        int64_t tileCol0 = col0 >> TILE_BITS, tileCol1 = (col1 - 1) >> TILE_BITS;
+        int64_t tileRow0 = row0 >> TILE_BITS, tileRow1 = (row1 - 1) >> TILE_BITS;
+        auto visit = [&](int64_t tileCol, int64_t tileRow, const Tile &tile) {
+            uint64_t columns = tile.columns & span(col0 - (tileCol << TILE_BITS), col1 - (tileCol << TILE_BITS));
+            uint64_t rows = span(row0 - (tileRow << TILE_BITS), row1 - (tileRow << TILE_BITS));
+            forEachBit(columns, [&](int col) { fn(tile, col, rows); });
+        };
+        if ((tileCol1 - tileCol0 + 1) * (tileRow1 - tileRow0 + 1) <= int64_t(tiles.size())) {
+            for (int64_t tileCol = tileCol0; tileCol <= tileCol1; tileCol++) {
+                for (int64_t tileRow = tileRow0; tileRow <= tileRow1; tileRow++) {
+                    if (const Tile *tile = tiles.find(tileKey(tileCol, tileRow))) visit(tileCol, tileRow, *tile);
+                }
+            }
+            return;
+        }
+        for (const auto &tile: tiles) {
+            int64_t tileCol = int32_t(tile.first >> 32), tileRow = int32_t(tile.first);
+            if (tileCol >= tileCol0 && tileCol <= tileCol1 && tileRow >= tileRow0 && tileRow <= tileRow1) {
+                visit(tileCol, tileRow, *tile.second);
+            }
+        }
     }
+};
 
+CellStore::CellStore(CellStore &&other) noexcept
+        : tiles(std::move(other.tiles)), columns(std::move(other.columns)), lookups(std::move(other.lookups)),
+          count(other.count) {
+    other.clear();
 }
 
-//the derived classes take from the stack themselves
-void MyExprBuilder::opAdd() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Addition>(stack));
+CellStore &CellStore::operator=(const CellStore &other) {
+    tiles = other.tiles;
+    columns = other.columns;
+    lookups.clear();
+    count = other.count;
+    return *this;
 }
 
-void MyExprBuilder::opSub() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Substraction>(stack));
+CellStore &CellStore::operator=(CellStore &&other) noexcept {
+    tiles = std::move(other.tiles);
+    columns = std::move(other.columns);
+    lookups = std::move(other.lookups);
+    count = other.count;
+    other.clear();
+    return *this;
 }
 
-void MyExprBuilder::opMul() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Multiplication>(stack));
+std::optional<int> CellStore::lookup(int col, int row0, int row1, const CValue &key, Match match, bool last) const {
+    const LookupIndex *index;
+    {
+        std::shared_lock<std::shared_mutex> guard(lookupsLock);
+        auto found = lookups.find(col);
+        index = found == lookups.end() ? nullptr : found->second.get();
+    }
+    if (index == nullptr) {
+        std::unique_lock<std::shared_mutex> guard(lookupsLock);
+        auto &slot = lookups[col];
+        if (!slot) {
+            slot = std::make_unique<LookupIndex>();
+            for (const auto &tile: tiles) {
+                if (int32_t(tile.first >> 32) != col >> TILE_BITS) continue;
+                int column = col & (TILE_SIZE - 1);
+                forEachBit(tile.second->occupied[column],
+                           [&](int row) { slot->add(*tile.second->cells[column * TILE_SIZE + row]); });
+            }
+        }
+        index = slot.get();
+    }
+    return index->find(key, match, row0, row1, last, [&](int row) -> const CValue & {
+        return find(CPos(col, row))->value(*this);
+    });
 }
 
-void MyExprBuilder::opDiv() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Division>(stack));
+const cellContents *CellStore::find(const CPos &pos) const {
+    const Tile *tile = tiles.find(tileKey(pos));
+    if (tile == nullptr) return nullptr;
+    return tile->cells[slot(pos)].get();
 }
 
-void MyExprBuilder::opPow() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Power>(stack));
+cellContents *CellStore::own(const CPos &pos) {
+    if (find(pos) == nullptr) return nullptr;
+    auto &cell = tiles.modify(tileKey(pos)).cells[slot(pos)];
+    if (cell.use_count() > 1) cell = std::make_shared<cellContents>(*cell, cell->pos);
+    return cell.get();
 }
 
+void CellStore::invalidate(const CPos &pos) {
+    own(pos)->dirty = true;
+    if (lookups.empty()) return;
+    auto lookup = lookups.find(pos.getColumn());
+    if (lookup != lookups.end()) lookup->second->invalidate(pos.getRow());
+}
 
-void MyExprBuilder::opNeg() {
-    if (stack.size() < 1) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Negation>(stack));
+void CellStore::invalidateLookups() {
+    for (auto &lookup: lookups) lookup.second->invalidateAll();
 }
 
-void MyExprBuilder::opEq() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<Equal>(stack));
+void CellStore::put(const CPos &pos, std::unique_ptr<cellContents> cell) {
+    uint64_t key = tileKey(pos);
+    if (!cell && tiles.find(key) == nullptr) return;
+    Tile &target = tiles.modify(key);
+    int index = slot(pos);
+    if (!lookups.empty()) {
+        auto lookup = lookups.find(pos.getColumn());
+        if (lookup != lookups.end()) {
+            if (target.cells[index]) lookup->second->remove(*target.cells[index]);
+            if (cell) lookup->second->add(*cell);
+        }
+    }
+    int column = index / TILE_SIZE;
+    uint64_t bit = uint64_t(1) << (index % TILE_SIZE);
+    int change = (cell != nullptr) - (target.cells[index] != nullptr);
+    target.occupied[column] &= ~bit;
+    target.numeric[column] &= ~bit;
+    if (cell) {
+        target.occupied[column] |= bit;
+        if (!cell->state && std::holds_alternative<double>(cell->val)) {
+            target.numeric[column] |= bit;
+            target.numbers[index] = std::get<double>(cell->val);
+        }
+    }
+    target.cells[index] = std::move(cell);
+    if (target.occupied[column]) target.columns |= uint64_t(1) << column;
+    else target.columns &= ~(uint64_t(1) << column);
+
+    if (pos.getRow() >= 0 && pos.getRow() < INDEXED_ROWS) {
+        // Summarizes the block again, at most 64 cells
+        ColumnIndex::Node leaf;
+        forEachBit(target.occupied[column] & ~target.numeric[column], [&](int row) {
+            if (target.cells[column * TILE_SIZE + row]->state) leaf.formulas++;
+            else leaf.texts++;
+        });
+        forEachBit(target.numeric[column], [&](int row) {
+            double val = target.numbers[column * TILE_SIZE + row];
+            leaf.sum += val;
+            leaf.min = std::min(leaf.min, val);
+            leaf.max = std::max(leaf.max, val);
+            leaf.numbers++;
+        });
+        ColumnIndex &index = columns.modify(pos.getColumn());
+        index.set(pos.getRow() >> TILE_BITS, leaf);
+        if (index.empty()) columns.erase(pos.getColumn());
+    }
+
+    target.used += change;
+    count += change;
+    if (target.used == 0) tiles.erase(key);
 }
 
-void MyExprBuilder::opNe() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<NotEqual>(stack));
+void CellStore::clear() {
+    tiles.clear();
+    columns.clear();
+    lookups.clear();
+    count = 0;
 }
 
-void MyExprBuilder::opLt() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<LessThan>(stack));
+Function functionByName(std::string name) {
+    for (auto &character: name) character = std::tolower(character);
+    if (name == "sum") return Function::Sum;
+    if (name == "avg" || name == "average") return Function::Avg;
+    if (name == "min") return Function::Min;
+    if (name == "max") return Function::Max;
+    if (name == "count") return Function::Count;
+    if (name == "countval") return Function::CountVal;
+    if (name == "if") return Function::If;
+    if (name == "countif") return Function::CountIf;
+    if (name == "sumif") return Function::SumIf;
+    if (name == "averageif" || name == "avgif") return Function::AverageIf;
+    if (name == "vlookup") return Function::VLookup;
+    if (name == "match") return Function::Match;
+    if (name == "xlookup") return Function::XLookup;
+    throw std::invalid_argument("Unknown function " + name);
 }
 
-void MyExprBuilder::opLe() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<LessEqual>(stack));
+const char *functionName(Function function) {
+    switch (function) {
+        case Function::Sum: return "SUM";
+        case Function::Avg: return "AVG";
+        case Function::Min: return "MIN";
+        case Function::Max: return "MAX";
+        case Function::Count: return "COUNT";
+        case Function::CountVal: return "COUNTVAL";
+        case Function::If: return "IF";
+        case Function::CountIf: return "COUNTIF";
+        case Function::SumIf: return "SUMIF";
+        case Function::AverageIf: return "AVERAGEIF";
+        case Function::VLookup: return "VLOOKUP";
+        case Function::Match: return "MATCH";
+        default: return "XLOOKUP";
+    }
 }
 
-void MyExprBuilder::opGt() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<GreaterThan>(stack));
+Signature signature(Function function) {
+    constexpr int ANY = std::numeric_limits<int>::max();
+    switch (function) {
+        case Function::CountVal: return {2, ANY, 0b1, 0};
+        case Function::If: return {3, 3, 0b111, 0};
+        case Function::CountIf: return {2, 2, 0b10, 0b1};  // Range, criterion
+        case Function::SumIf:
+        case Function::AverageIf: return {2, 3, 0b10, 0b101};  // Range, criterion, values
+        case Function::VLookup: return {3, 4, 0b1101, 0b10};  // Key, table, column, approximate
+        case Function::Match: return {2, 3, 0b101, 0b10};  // Key, vector, match type
+        case Function::XLookup: return {3, 6, 0b111001, 0b110};  // Key, keys, results, missing, mode, order
+        default: return {1, ANY, 0, 0};
+    }
 }
 
-void MyExprBuilder::opGe() {
-    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
-    stack.push(std::make_shared<GreaterEqual>(stack));
+// Position of key in a range of one column or one row, counted from 0
+std::optional<int> findInVector(const CellStore &cells, const CRange &vector, const CValue &key, Match match,
+                                bool last) {
+    if (vector.from.getColumn() == vector.to.getColumn()) {
+        auto row = cells.lookup(vector.from.getColumn(), vector.from.getRow(), vector.to.getRow(), key, match, last);
+        if (!row) return std::nullopt;
+        return *row - vector.from.getRow();
+    }
+    if (vector.from.getRow() != vector.to.getRow()) return std::nullopt;
+    // Rows have no index, they are scanned
+    std::optional<std::pair<CValue, int>> best;
+    for (int col = vector.from.getColumn(); col <= vector.to.getColumn(); col++) {
+        const cellContents *cell = cells.find(CPos(col, vector.from.getRow()));
+        if (cell == nullptr) continue;
+        const CValue &val = cell->value(cells);
+        if (!matchesKey(val, key, match)) continue;
+        if (!best || betterMatch(val, col, best->first, best->second, match, last)) best.emplace(val, col);
+    }
+    if (!best) return std::nullopt;
+    return best->second - vector.from.getColumn();
 }
 
-void MyExprBuilder::valNumber(double val) {
-    stack.push(std::make_shared<Number>(val));
+// Value of the cell at position index of a range of one column or one row
+CValue vectorElement(const CellStore &cells, const CRange &vector, int index) {
+    bool column = vector.from.getColumn() == vector.to.getColumn() || vector.from.getRow() != vector.to.getRow();
+    CPos pos = column ? CPos(vector.from.getColumn(), vector.from.getRow() + index)
+                      : CPos(vector.from.getColumn() + index, vector.from.getRow());
+    if (!vector.contains(pos)) return CValue();
+    const cellContents *cell = cells.find(pos);
+    return cell ? cell->value(cells) : CValue();
 }
 
-void MyExprBuilder::valString(std::string val) {
-    stack.push(std::make_shared<String>(std::move(val)));
+// Numeric option of a function, def when missing or not a number
+double option(const Argument *args, int count, int i, double def) {
+    if (i >= count || !std::holds_alternative<double>(args[i].value)) return def;
+    return std::get<double>(args[i].value);
+}
+
+bool is_number(const std::string &s);
+
+// Criterion of COUNTIF, SUMIF and AVERAGEIF like ">=100", "<>done" or 5, parsed once per call.
+// Values are compared like the comparison operators do: numbers with numbers, strings with strings.
+class Criterion {
+public:
+    explicit Criterion(const CValue &criterion);
+
+    bool matches(const CValue &val) const {
+        return compareValues(val, operand, [&](const auto &l, const auto &r) { return compare(l, r); }) == CValue(1.0);
+    }
 
+    // Tests a cell. The string constants of a sheet are interned in one pool, so for = and <> with a
+    // string the first one equal to the operand stands for all of them and the others are told apart
+    // by address. Formulas and relational criteria compare the values.
+    bool matches(const cellContents &cell, const CellStore &cells) {
+        if (!byHandle || cell.text == nullptr) return matches(cell.value(cells));
+        if (handle == nullptr) {
+            if (std::get<std::string>(*cell.text) != std::get<std::string>(operand)) return op == OpCode::Ne;
+            handle = cell.text;
+        }
+        return (cell.text == handle) == (op == OpCode::Eq);
+    }
+
+    // Counts the numbers of a run that match and adds them to sum
+    void foldNumbers(const double *vals, int n, double &sum, double &count) const;
+
+private:
+    OpCode op = OpCode::Eq;  // One of the comparison opcodes
+    CValue operand;
+    bool byHandle = false;  // = or <> with a string, string constants are compared by address
+    const CValue *handle = nullptr;  // Interned value equal to the operand, once a cell has shown it
+
+    template<typename T>
+    bool compare(const T &l, const T &r) const {
+        switch (op) {
+            case OpCode::Eq: return l == r;
+            case OpCode::Ne: return l != r;
+            case OpCode::Lt: return l < r;
+            case OpCode::Le: return l <= r;
+            case OpCode::Gt: return l > r;
+            default: return l >= r;
+        }
+    }
+
+    template<typename Cmp>
+    static void foldNumbers(const double *vals, int n, double operand, Cmp cmp, double &sum, double &count);
+};
+
+Criterion::Criterion(const CValue &criterion) {
+    auto text = std::get_if<std::string>(&criterion);
+    if (text == nullptr) {
+        operand = criterion;
+        return;
+    }
+    std::string_view rest = *text;
+    static const std::pair<std::string_view, OpCode> prefixes[] = {
+            {"<=", OpCode::Le}, {">=", OpCode::Ge}, {"<>", OpCode::Ne}, {"<", OpCode::Lt}, {">", OpCode::Gt},
+            {"=",  OpCode::Eq}};
+    for (const auto &prefix: prefixes) {
+        if (rest.substr(0, prefix.first.size()) == prefix.first) {
+            op = prefix.second;
+            rest.remove_prefix(prefix.first.size());
+            break;
+        }
+    }
+    std::string value(rest);
+    if (is_number(value)) operand = std::stod(value);
+    else operand = value;
+    byHandle = std::holds_alternative<std::string>(operand) && (op == OpCode::Eq || op == OpCode::Ne);
 }
 
-// arr to be able to copy correctly
-void MyExprBuilder::valReference(std::string val) {
-    stack.push(std::make_shared<Reference>(std::move(val), arr));
+template<typename Cmp>
+void Criterion::foldNumbers(const double *vals, int n, double operand, Cmp cmp, double &sum, double &count) {
+    // Branch-free lanes like Aggregate::addNumbers, so the loop vectorizes
+    constexpr int LANES = 4;
+    double sums[LANES] = {}, counts[LANES] = {};
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (int lane = 0; lane < LANES; lane++) {
+            bool hit = cmp(vals[i + lane], operand);
+            sums[lane] += hit ? vals[i + lane] : 0.0;
+            counts[lane] += hit;
+        }
+    }
+    for (; i < n; i++) {
+        bool hit = cmp(vals[i], operand);
+        sum += hit ? vals[i] : 0.0;
+        count += hit;
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        sum += sums[lane];
+        count += counts[lane];
+    }
 }
 
-void MyExprBuilder::valRange(std::string val) {
-//not finished
+void Criterion::foldNumbers(const double *vals, int n, double &sum, double &count) const {
+    auto number = std::get_if<double>(&operand);
+    if (number == nullptr) return;
+    switch (op) {
+        case OpCode::Eq: return foldNumbers(vals, n, *number, std::equal_to<>(), sum, count);
+        case OpCode::Ne: return foldNumbers(vals, n, *number, std::not_equal_to<>(), sum, count);
+        case OpCode::Lt: return foldNumbers(vals, n, *number, std::less<>(), sum, count);
+        case OpCode::Le: return foldNumbers(vals, n, *number, std::less_equal<>(), sum, count);
+        case OpCode::Gt: return foldNumbers(vals, n, *number, std::greater<>(), sum, count);
+        default: return foldNumbers(vals, n, *number, std::greater_equal<>(), sum, count);
+    }
 }
 
-void MyExprBuilder::funcCall(std::string fnName, int paramCount) {
-//not finished
+// COUNTIF, SUMIF and AVERAGEIF: the cells of the first range matching the criterion pick the
+// values, taken from the same offsets of the optional third range or else from the cells themselves
+CValue callConditional(Function function, const Argument *args, int count, const CellStore &cells) {
+    const CRange &range = args[0].range;
+    Criterion criterion(args[1].value);
+    double sum = 0, matched = 0, numbers = 0;
+    auto add = [&](const CValue &val) {
+        if (auto number = std::get_if<double>(&val)) {
+            sum += *number;
+            numbers++;
+        }
+    };
+    if (count == 2) {
+        cells.scanIn(range.from.getColumn(), range.from.getRow(), range.to.getColumn() + 1, range.to.getRow() + 1,
+                     [&](const double *vals, int n) {
+                         double hits = 0;
+                         criterion.foldNumbers(vals, n, sum, hits);
+                         matched += hits;
+                         numbers += hits;
+                     },
+                     [&](const cellContents &cell) {
+                         if (!criterion.matches(cell, cells)) return;
+                         matched++;
+                         add(cell.value(cells));
+                     });
+    } else {
+        int colMove = args[2].range.from.getColumn() - range.from.getColumn();
+        int rowMove = args[2].range.from.getRow() - range.from.getRow();
+        cells.forEachIn(range.from.getColumn(), range.from.getRow(), range.to.getColumn() + 1, range.to.getRow() + 1,
+                        [&](const cellContents &cell) {
+                            if (!criterion.matches(cell, cells)) return;
+                            matched++;
+                            CPos pos(cell.pos.getColumn() + colMove, cell.pos.getRow() + rowMove);
+                            if (const cellContents *target = cells.find(pos)) add(target->value(cells));
+                        });
+    }
+    if (function == Function::CountIf) return matched;
+    if (function == Function::SumIf) return numbers ? CValue(sum) : CValue();
+    return numbers ? CValue(sum / numbers) : CValue();
 }
 
-std::shared_ptr<ExprNode> MyExprBuilder::getRoot() const {
-    if (stack.empty()) {
-        throw std::invalid_argument("stack empty");
+CValue callOnRanges(Function function, const Argument *args, int count, const CellStore &cells) {
+    if (function < Function::VLookup) return callConditional(function, args, count, cells);
+    const CValue &key = args[0].value;
+    if (function == Function::VLookup) {
+        // Searches the first column of the table and returns the same row of another column
+        const CRange &table = args[1].range;
+        double column = option(args, count, 2, 0);
+        if (column < 1 || column > table.to.getColumn() - table.from.getColumn() + 1) return CValue();
+        Match match = option(args, count, 3, 1) != 0 ? Match::Below : Match::Exact;
+        auto row = cells.lookup(table.from.getColumn(), table.from.getRow(), table.to.getRow(), key, match, false);
+        if (!row) return CValue();
+        const cellContents *cell = cells.find(CPos(table.from.getColumn() + int(column) - 1, *row));
+        return cell ? cell->value(cells) : CValue();
     }
-    if (stack.size() > 1) {
-        throw std::invalid_argument("incorrect input, elements > 1");
+    if (function == Function::Match) {
+        double type = option(args, count, 2, 1);
+        Match match = type > 0 ? Match::Below : type < 0 ? Match::Above : Match::Exact;
+        auto index = findInVector(cells, args[1].range, key, match, false);
+        if (!index) return CValue();
+        return double(*index + 1);
     }
-    return std::move(stack.top());
+    double mode = option(args, count, 4, 0);
+    Match match = mode < 0 ? Match::Below : mode > 0 && mode < 2 ? Match::Above : Match::Exact;
+    auto index = findInVector(cells, args[1].range, key, match, option(args, count, 5, 1) < 0);
+    if (!index) return count > 3 ? args[3].value : CValue();
+    return vectorElement(cells, args[2].range, *index);
 }
 
-// Helper function to check if a string is a number
-bool is_number(const std::string &s) {
-    char *end = nullptr;
-    double val = strtod(s.c_str(), &end);
-    return end != s.c_str() && *end == '\0' && val != HUGE_VAL;
+void Aggregate::add(double val) {
+    sum += val;
+    min = val < min ? val : min;
+    max = val > max ? val : max;
+    numbers++;
+    values++;
 }
 
-// Determines if the input is an expression, string, or number
-cellContents::cellContents(std::string input, const std::map<CPos, std::shared_ptr<cellContents>> &array) : expression(
-        array) {
-    if (input[0] == '=') {
-        parseExpression(input, expression);
-        state = true;
-        return;
+void Aggregate::add(const CValue &val) {
+    if (auto number = std::get_if<double>(&val)) add(*number);
+    else if (std::holds_alternative<std::string>(val)) values++;
+}
+
+void Aggregate::addNumbers(const double *vals, int n) {
+    // Independent lanes break the dependency between iterations so the loop vectorizes
+    constexpr int LANES = 4;
+    double sums[LANES] = {}, mins[LANES], maxs[LANES];
+    for (int lane = 0; lane < LANES; lane++) {
+        mins[lane] = min;
+        maxs[lane] = max;
     }
-    if (input.empty()) {
-        val = "";
-        state = false;
-        return;
+    int i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (int lane = 0; lane < LANES; lane++) {
+            double val = vals[i + lane];
+            sums[lane] += val;
+            mins[lane] = val < mins[lane] ? val : mins[lane];
+            maxs[lane] = val > maxs[lane] ? val : maxs[lane];
+        }
     }
-
-    state = false;
-    if (is_number(input)) {
-        val = std::stod(input);
-        return;
-    } else {
-        val = input;
+    for (int lane = 0; lane < LANES; lane++) {
+        sum += sums[lane];
+        min = mins[lane] < min ? mins[lane] : min;
+        max = maxs[lane] > max ? maxs[lane] : max;
     }
+    numbers += i;
+    values += i;
+    for (; i < n; i++) add(vals[i]);
 }
 
-cellContents::cellContents(const cellContents &other, const std::map<CPos, std::shared_ptr<cellContents>> &array, int w, int h)
-        : expression(other.expression, array, w, h) {
-    state = other.state;
-    val = other.val;
+void Aggregate::addRange(const CellStore &cells, const CRange &range) {
+    cells.foldIn(range.from.getColumn(), range.from.getRow(), range.to.getColumn() + 1, range.to.getRow() + 1, *this,
+                 [&](const cellContents &cell) { add(cell.value(cells)); });
 }
 
-CValue cellContents::getResult() const {
-    if (state == false) {
-        return val;
-    } else {
-        return expression.getRoot()->eval();
+CValue Aggregate::result(Function function) const {
+    switch (function) {
+        case Function::Count: return double(values);
+        case Function::Sum: return numbers ? CValue(sum) : CValue();
+        case Function::Avg: return numbers ? CValue(sum / numbers) : CValue();
+        case Function::Min: return numbers ? CValue(min) : CValue();
+        default: return numbers ? CValue(max) : CValue();
+    }
+}
+
+double countMatches(const CValue &target, const CellStore &cells, const CRange &range) {
+    double matches = 0;
+    const double *number = std::get_if<double>(&target);
+    cells.scanIn(range.from.getColumn(), range.from.getRow(), range.to.getColumn() + 1, range.to.getRow() + 1,
+                 [&](const double *vals, int n) {
+                     if (number == nullptr) return;
+                     int found = 0;
+                     for (int i = 0; i < n; i++) found += vals[i] == *number;
+                     matches += found;
+                 },
+                 [&](const cellContents &cell) {
+                     matches += compareValues(target, cell.value(cells), std::equal_to<>()) == CValue(1.0);
+                 });
+    return matches;
+}
+
+// Abstract base class for expression nodes
+class ExprNode {
+public:
+
+    virtual CValue eval(const EvalContext &ctx) const = 0;  // Evaluates the expression node
+
+    virtual const ExprNode *clone(NodeArena &arena) const = 0;  // Deep copy into another arena
+
+    virtual void write(std::string &out, const CPos &origin) const = 0;  // Appends the text of the expression
+
+    // Converts the expression to a string, starting with = for a whole formula
+    std::string toString(const CPos &origin, bool top) const {
+        std::string ret = top ? "=" : "";
+        write(ret, origin);
+        return ret;
+    }
+
+    virtual void references(const CPos &origin, Precedents &out) const = 0;  // Collects positions the expression reads
+
+    virtual void compile(Bytecode &out) const = 0;  // Appends the postfix instructions of the expression
+
+    virtual bool constant() const { return false; }  // True if the expression reads no cells
+
+    virtual bool numeric() const { return false; }  // True if the value is always a number or empty
+
+protected:
+    ~ExprNode() = default;  // Nodes live in a NodeArena and are never deleted individually
+};
+
+// Expression node for numbers
+class Number : public ExprNode {
+public:
+    Number(double input) {
+        val = input;
+    }
+
+    CValue eval(const EvalContext &) const override {
+        return CValue(val);
+    }
+
+    Number(const Number &other, NodeArena &) {
+        val = other.val;
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Number>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &) const override {
+        // The parser reads no negative literals, folded ones are written as a negation
+        if (std::signbit(val)) {
+            out += "(-";
+            appendNumber(out, -val);
+            out += ')';
+        } else {
+            appendNumber(out, val);
+        }
+    }
+
+    void references(const CPos &, Precedents &) const override {}
+
+    void compile(Bytecode &out) const override {
+        out.emitNumber(val);
+    }
+
+    bool constant() const override {
+        return true;
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+    double value() const {
+        return val;
+    }
+
+private:
+    double val;
+};
+
+// Expression node for strings
+class String : public ExprNode {
+public:
+    explicit String(std::string_view input) {
+        val = input;
+    }
+
+    CValue eval(const EvalContext &) const override {
+        return CValue(std::string(val));
+    }
+
+    String(const String &other, NodeArena &arena) {
+        val = arena.copy(other.val);
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<String>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &) const override {
+        // Quoted the way the parser reads it, with quotes inside doubled
+        out += '"';
+        for (char c: val) {
+            if (c == '"') out += '"';
+            out += c;
+        }
+        out += '"';
+    }
+
+    void references(const CPos &, Precedents &) const override {}
+
+    void compile(Bytecode &out) const override {
+        out.emitString(val);
+    }
+
+    bool constant() const override {
+        return true;
+    }
+
+private:
+    std::string_view val;  // Characters are owned by the arena
+};
+
+// Expression node for cell references
+class Reference : public ExprNode {
+public:
+    // Parses a cell reference, handling fixed positions with '$'. Coordinates that are not
+    // fixed are stored as offsets from origin, so the node reads the same relative cell anywhere.
+    Reference(std::string input, const CPos &origin) {
+        CPos temp;
+        bool intPresent = false;
+        bool charPresent = false;
+        fixed1 = false;
+        fixed2 = false;
+        if (input.empty()) throw std::invalid_argument("Invalid_Argument");
+
+        for (size_t i = 0; i < input.size(); i++) {
+            input[i] = std::toupper(input[i]);
+
+            if (input[i] == '$') {
+                if (charPresent == false && i == 0 && fixed1 == false) {
+                    fixed1 = true;
+                } else if ((intPresent == false && fixed2 == false)) {
+                    if (charPresent == false) throw std::invalid_argument("Invalid_Argument");
+                    fixed2 = true;
+                } else throw std::invalid_argument("Invalid_Argument");
+
+            } else if (input[i] >= 65 && input[i] <= 90) {
+                charPresent = true;
+                if (intPresent) throw std::invalid_argument("Invalid_Argument");
+                temp.setColumn(temp.getColumn() * 26 + (input[i] - 'A' + 1));
+
+            } else if (input[i] >= 48 && input[i] <= 57) {
+                intPresent = true;
+                if (!charPresent) throw std::invalid_argument("Invalid_Argument");
+                temp.setRow(temp.getRow() * 10 + (input[i] - '0'));
+            } else {
+                throw std::invalid_argument("Invalid_Argument");
+            }
+        }
+        if (!intPresent) throw std::invalid_argument("Invalid_Argument");
+        if (!fixed1) temp.setColumn(temp.getColumn() - origin.getColumn());
+        if (!fixed2) temp.setRow(temp.getRow() - origin.getRow());
+        position = temp;
+    }
+
+    Reference(const Reference &other, NodeArena &) :
+            position(other.position), fixed1(other.fixed1), fixed2(other.fixed2) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        // Evaluates the referenced cell's value
+        if (const cellContents *cell = ctx.cells.find(resolve(ctx.origin))) {
+            return cell->getResult(ctx.cells);
+        }
+        return CValue();
+    }
+
+    // Position the reference points to when evaluated at origin
+    CPos resolve(const CPos &origin) const {
+        return CPos(fixed1 ? position.getColumn() : origin.getColumn() + position.getColumn(),
+                    fixed2 ? position.getRow() : origin.getRow() + position.getRow());
+    }
+
+    // Appends the relative form of the reference to a template key
+    void appendKey(std::string &key) const {
+        key += 'r';
+        if (fixed1) key += '$';
+        key += std::to_string(position.getColumn());
+        key += ',';
+        if (fixed2) key += '$';
+        key += std::to_string(position.getRow());
+        key += ';';
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Reference>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        // Converts the reference back to string format
+        CPos target = resolve(origin);
+        if (fixed1) out += '$';
+        target.appendColumn(out);
+        if (fixed2) out += '$';
+        appendNumber(out, target.getRow());
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        out.cells.push_back(resolve(origin));
+    }
+
+    void compile(Bytecode &out) const override {
+        out.emitReference(operand());
+    }
+
+    CellOperand operand() const {
+        return {position.getColumn(), position.getRow(), fixed1, fixed2};
+    }
+
+private:
+    CPos position;  // Absolute on fixed axes, offset from the evaluated cell otherwise
+    bool fixed1, fixed2;
+};
+
+// Expression node for addition
+class Addition : public ExprNode {
+public:
+    Addition(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+    }
+
+    Addition(const Addition &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return addValues(left->eval(ctx), right->eval(ctx));
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Addition>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        // Converts addition back to string format
+        out += '(';
+        left->write(out, origin);
+        out += '+';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Add);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return left->numeric() && right->numeric();
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class Substraction : public ExprNode {
+public:
+    Substraction(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    Substraction(const Substraction &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return subValues(left->eval(ctx), right->eval(ctx));
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Substraction>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '-';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Sub);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class Multiplication : public ExprNode {
+public:
+    Multiplication(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    Multiplication(const Multiplication &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return mulValues(left->eval(ctx), right->eval(ctx));
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Multiplication>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '*';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Mul);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class Division : public ExprNode {
+public:
+    Division(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    Division(const Division &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return divValues(left->eval(ctx), right->eval(ctx));
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Division>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '/';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Div);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class Power : public ExprNode {
+public:
+    Power(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    Power(const Power &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return powValues(left->eval(ctx), right->eval(ctx));
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '^';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Power>(*this, arena);
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Pow);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+
+};
+
+class Negation : public ExprNode {
+public:
+    Negation(std::stack<const ExprNode *> &stack) {
+        single = std::move(stack.top());
+        stack.pop();
+
+
+    }
+
+    Negation(const Negation &other, NodeArena &arena)
+            : single(other.single->clone(arena)) {}
+
+
+    CValue eval(const EvalContext &ctx) const override {
+        return negValue(single->eval(ctx));
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Negation>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += "(-";
+        single->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        single->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        single->compile(out);
+        out.emit(OpCode::Neg);
+    }
+
+    bool constant() const override {
+        return single->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+    const ExprNode *operand() const {
+        return single;
+    }
+
+private:
+    const ExprNode *single;
+};
+
+class Equal : public ExprNode {
+public:
+    Equal(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    Equal(const Equal &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+
+    CValue eval(const EvalContext &ctx) const override {
+        return compareValues(left->eval(ctx), right->eval(ctx), std::equal_to<>());
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Equal>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '=';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Eq);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class NotEqual : public ExprNode {
+public:
+    NotEqual(std::stack<const ExprNode *> &stack) {
+        right = stack.top();
+        stack.pop();
+        left = stack.top();
+        stack.pop();
+
+    }
+
+    NotEqual(const NotEqual &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return compareValues(left->eval(ctx), right->eval(ctx), std::not_equal_to<>());
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<NotEqual>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += "<>";
+        right->write(out, origin);
+        out += ')';
+    }
+
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Ne);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class LessThan : public ExprNode {
+public:
+    LessThan(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    LessThan(const LessThan &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+
+    CValue eval(const EvalContext &ctx) const override {
+        return compareValues(left->eval(ctx), right->eval(ctx), std::less<>());
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<LessThan>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '<';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Lt);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class LessEqual : public ExprNode {
+public:
+    LessEqual(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    LessEqual(const LessEqual &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+    CValue eval(const EvalContext &ctx) const override {
+        return compareValues(left->eval(ctx), right->eval(ctx), std::less_equal<>());
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<LessEqual>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += "<=";
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Le);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class GreaterThan : public ExprNode {
+public:
+    GreaterThan(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    GreaterThan(const GreaterThan &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+
+    CValue eval(const EvalContext &ctx) const override {
+        return compareValues(left->eval(ctx), right->eval(ctx), std::greater<>());
+    }
+
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<GreaterThan>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += '>';
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Gt);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+class GreaterEqual : public ExprNode {
+public:
+    GreaterEqual(std::stack<const ExprNode *> &stack) {
+        right = std::move(stack.top());
+        stack.pop();
+        left = std::move(stack.top());
+        stack.pop();
+
+    }
+
+    GreaterEqual(const GreaterEqual &other, NodeArena &arena)
+            : left(other.left->clone(arena)), right(other.right->clone(arena)) {}
+
+
+    CValue eval(const EvalContext &ctx) const override {
+        return compareValues(left->eval(ctx), right->eval(ctx), std::greater_equal<>());
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<GreaterEqual>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += '(';
+        left->write(out, origin);
+        out += ">=";
+        right->write(out, origin);
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        left->references(origin, out);
+        right->references(origin, out);
+    }
+
+    void compile(Bytecode &out) const override {
+        left->compile(out);
+        right->compile(out);
+        out.emit(OpCode::Ge);
+    }
+
+    bool constant() const override {
+        return left->constant() && right->constant();
+    }
+
+    bool numeric() const override {
+        return true;
+    }
+
+private:
+    const ExprNode *left;
+    const ExprNode *right;
+};
+
+// Expression node for a rectangle of cells like A1:B$10, only valid as a function argument
+class Range : public ExprNode {
+public:
+    Range(const std::string &input, const CPos &origin)
+            : first(corner(input, true), origin), second(corner(input, false), origin) {}
+
+    Range(const Range &other, NodeArena &arena) : first(other.first, arena), second(other.second, arena) {}
+
+    CValue eval(const EvalContext &) const override {
+        throw std::invalid_argument("Range is not a value");
+    }
+
+    // Cells the range covers when evaluated at origin
+    CRange resolve(const CPos &origin) const {
+        return RangeOperand{first.operand(), second.operand()}.resolve(origin);
+    }
+
+    void appendKey(std::string &key) const {
+        key += 'R';
+        first.appendKey(key);
+        second.appendKey(key);
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<Range>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        first.write(out, origin);
+        out += ':';
+        second.write(out, origin);
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        out.ranges.push_back(resolve(origin));
+    }
+
+    void compile(Bytecode &out) const override {
+        out.emitRange({first.operand(), second.operand()});
+    }
+
+private:
+    Reference first, second;
+
+    static std::string corner(const std::string &input, bool first) {
+        size_t colon = input.find(':');
+        if (colon == std::string::npos) throw std::invalid_argument("Invalid_Argument");
+        return first ? input.substr(0, colon) : input.substr(colon + 1);
+    }
+};
+
+// Expression node for a function call, its arguments are stored in the arena
+class FunctionCall : public ExprNode {
+public:
+    FunctionCall(Function function, std::stack<const ExprNode *> &stack, int count, NodeArena &arena)
+            : function(function), args(arena.makeArray<const ExprNode *>(count)), count(count) {
+        for (int i = count - 1; i >= 0; i--) {
+            args[i] = stack.top();
+            stack.pop();
+        }
+        Signature sig = signature(function);
+        for (int i = 0; i < count; i++) {
+            bool range = dynamic_cast<const Range *>(args[i]) != nullptr;
+            if (range && i < 32 && (sig.values >> i & 1)) throw std::invalid_argument("Range is not a value");
+            if (!range && i < 32 && (sig.ranges >> i & 1)) throw std::invalid_argument("Argument must be a range");
+        }
+    }
+
+    FunctionCall(const FunctionCall &other, NodeArena &arena)
+            : function(other.function), args(arena.makeArray<const ExprNode *>(other.count)), count(other.count) {
+        for (int i = 0; i < count; i++) {
+            args[i] = other.args[i]->clone(arena);
+        }
+    }
+
+    CValue eval(const EvalContext &ctx) const override {
+        if (function == Function::If) {
+            CValue condition = args[0]->eval(ctx);
+            if (!std::holds_alternative<double>(condition)) return CValue();
+            return std::get<double>(condition) != 0 ? args[1]->eval(ctx) : args[2]->eval(ctx);
+        }
+        if (function >= Function::CountIf) {
+            Argument values[6];
+            for (int i = 0; i < count; i++) {
+                if (auto range = dynamic_cast<const Range *>(args[i])) values[i] = {true, range->resolve(ctx.origin), {}};
+                else values[i] = {false, {}, args[i]->eval(ctx)};
+            }
+            return callOnRanges(function, values, count, ctx.cells);
+        }
+        if (function == Function::CountVal) {
+            CValue target = args[0]->eval(ctx);
+            double matches = 0;
+            for (int i = 1; i < count; i++) {
+                if (auto range = dynamic_cast<const Range *>(args[i])) {
+                    matches += countMatches(target, ctx.cells, range->resolve(ctx.origin));
+                } else {
+                    matches += compareValues(target, args[i]->eval(ctx), std::equal_to<>()) == CValue(1.0);
+                }
+            }
+            return matches;
+        }
+        Aggregate aggregate;
+        for (int i = 0; i < count; i++) {
+            if (auto range = dynamic_cast<const Range *>(args[i])) {
+                aggregate.addRange(ctx.cells, range->resolve(ctx.origin));
+            } else {
+                aggregate.add(args[i]->eval(ctx));
+            }
+        }
+        return aggregate.result(function);
+    }
+
+    const ExprNode *clone(NodeArena &arena) const override {
+        return arena.make<FunctionCall>(*this, arena);
+    }
+
+    void write(std::string &out, const CPos &origin) const override {
+        out += functionName(function);
+        out += '(';
+        for (int i = 0; i < count; i++) {
+            if (i) out += ',';
+            args[i]->write(out, origin);
+        }
+        out += ')';
+    }
+
+    void references(const CPos &origin, Precedents &out) const override {
+        for (int i = 0; i < count; i++) {
+            args[i]->references(origin, out);
+        }
+    }
+
+    void compile(Bytecode &out) const override {
+        for (int i = 0; i < count; i++) {
+            args[i]->compile(out);
+        }
+        out.emitCall(function, count);
+    }
+
+    bool constant() const override {
+        for (int i = 0; i < count; i++) {
+            if (!args[i]->constant()) return false;
+        }
+        return true;
+    }
+
+    bool numeric() const override {
+        // Only IF and the lookups can pass a string on
+        if (function == Function::If) return args[1]->numeric() && args[2]->numeric();
+        return function != Function::VLookup && function != Function::XLookup;
+    }
+
+private:
+    Function function;
+    const ExprNode **args;
+    int count;
+};
+
+MyExprBuilder::MyExprBuilder(NodeArena &arena, const CPos &origin) : arena(arena), origin(origin) {}
+
+//the derived classes take from the stack themselves
+void MyExprBuilder::opAdd() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<Addition>(stack));
+    key += '+';
+}
+
+void MyExprBuilder::opSub() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    if (!dropIdentity(0, false)) push(arena.make<Substraction>(stack));
+    key += '-';
+}
+
+void MyExprBuilder::opMul() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    if (!dropIdentity(1, true)) push(arena.make<Multiplication>(stack));
+    key += '*';
+}
+
+void MyExprBuilder::opDiv() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    if (!dropIdentity(1, false)) push(arena.make<Division>(stack));
+    key += '/';
+}
+
+void MyExprBuilder::opPow() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    if (!dropIdentity(1, false)) push(arena.make<Power>(stack));
+    key += '^';
+}
+
+
+void MyExprBuilder::opNeg() {
+    if (stack.size() < 1) throw std::invalid_argument("Not enough on stack");
+    // Double negation gives back a numeric operand, a string one would turn empty
+    auto inner = dynamic_cast<const Negation *>(stack.top());
+    if (inner && inner->operand()->numeric()) {
+        stack.pop();
+        stack.push(inner->operand());
+    } else {
+        push(arena.make<Negation>(stack));
+    }
+    key += '~';
+}
+
+void MyExprBuilder::opEq() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<Equal>(stack));
+    key += '=';
+}
+
+void MyExprBuilder::opNe() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<NotEqual>(stack));
+    key += '!';
+}
+
+void MyExprBuilder::opLt() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<LessThan>(stack));
+    key += '<';
+}
+
+void MyExprBuilder::opLe() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<LessEqual>(stack));
+    key += 'l';
+}
+
+void MyExprBuilder::opGt() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<GreaterThan>(stack));
+    key += '>';
+}
+
+void MyExprBuilder::opGe() {
+    if (stack.size() < 2) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<GreaterEqual>(stack));
+    key += 'g';
+}
+
+void MyExprBuilder::valNumber(double val) {
+    stack.push(arena.make<Number>(val));
+    key += 'n';
+    key.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+void MyExprBuilder::valString(std::string val) {
+    stack.push(arena.make<String>(arena.copy(val)));
+    key += 's' + std::to_string(val.size()) + ':' + val;
+}
+
+// origin to store the reference relative to the cell
+void MyExprBuilder::valReference(std::string val) {
+    auto ref = arena.make<Reference>(std::move(val), origin);
+    stack.push(ref);
+    ref->appendKey(key);
+}
+
+void MyExprBuilder::valRange(std::string val) {
+    auto range = arena.make<Range>(val, origin);
+    stack.push(range);
+    range->appendKey(key);
+}
+
+void MyExprBuilder::funcCall(std::string fnName, int paramCount) {
+    Function function = functionByName(std::move(fnName));
+    Signature sig = signature(function);
+    if (paramCount < sig.minArgs || paramCount > sig.maxArgs) {
+        throw std::invalid_argument(std::string(functionName(function)) + " takes a different number of arguments");
+    }
+    if (stack.size() < size_t(paramCount)) throw std::invalid_argument("Not enough on stack");
+    push(arena.make<FunctionCall>(function, stack, paramCount, arena));
+    key += 'F' + std::to_string(int(function)) + ',' + std::to_string(paramCount) + ';';
+}
+
+const ExprNode *MyExprBuilder::getRoot() const {
+    if (stack.empty()) {
+        throw std::invalid_argument("stack empty");
+    }
+    if (stack.size() > 1) {
+        throw std::invalid_argument("incorrect input, elements > 1");
+    }
+    if (dynamic_cast<const Range *>(stack.top())) {
+        throw std::invalid_argument("Range is not a value");
+    }
+    return stack.top();
+}
+
+const std::string &MyExprBuilder::getKey() const {
+    return key;
+}
+
+void MyExprBuilder::push(const ExprNode *node) {
+    if (node->constant()) {
+        // Only values a literal can write back are folded, empty and infinite results stay as built
+        static const CellStore none;
+        CValue val = node->eval(EvalContext{none, origin});
+        if (auto number = std::get_if<double>(&val); number && std::isfinite(*number)) {
+            node = arena.make<Number>(*number);
+        } else if (auto text = std::get_if<std::string>(&val)) {
+            node = arena.make<String>(arena.copy(*text));
+        }
+    }
+    stack.push(node);
+}
+
+bool MyExprBuilder::dropIdentity(double identity, bool commutative) {
+    // -0 is no identity, -0 - -0 is 0
+    auto isIdentity = [identity](const ExprNode *node) {
+        auto number = dynamic_cast<const Number *>(node);
+        return number && number->value() == identity && !std::signbit(number->value());
+    };
+    const ExprNode *right = stack.top();
+    stack.pop();
+    const ExprNode *left = stack.top();
+    if (isIdentity(right) && left->numeric()) return true;
+    if (commutative && isIdentity(left) && right->numeric()) {
+        stack.pop();
+        stack.push(right);
+        return true;
+    }
+    stack.push(right);
+    return false;
+}
+
+// Immutable, position-independent formula. Every cell whose formula has the same relative
+// form points to one template, so filling a formula down shares a single tree and program.
+struct FormulaTemplate {
+    const ExprNode *root;
+    Bytecode code;
+    std::string_view key;  // Relative form the template is interned under, owned by its pool
+
+    explicit FormulaTemplate(const ExprNode *root) : root(root) {
+        root->compile(code);
+        code.shareRepeats();
+    }
+};
+
+// Hash-conses the templates and the string constants of one or more spreadsheets and owns them.
+// Cells point to the entries without counting references, so a pool only grows and entries are
+// never released one by one. A sheet replaces its pool instead: load starts a new one, and compact
+// moves the entries the cells still use to a new pool once the old one holds more than twice as
+// many. Copies still using the old pool keep it alive, it is freed with the last of them.
+class TemplatePool {
+public:
+    // Returns the template equal to the builder's finished expression, creating it if new
+    const FormulaTemplate *intern(const MyExprBuilder &builder);
+
+    // Returns the template of this pool equal to one of another pool, copying it if new
+    const FormulaTemplate *intern(const FormulaTemplate &formula);
+
+    // Returns the value of a string constant. Equal strings share one value, so two interned
+    // strings of a pool are equal exactly when their addresses are.
+    const CValue *intern(std::string_view text);
+
+    size_t size();  // Templates and strings held
+
+private:
+    std::mutex lock;
+    NodeArena arena;
+    std::unordered_map<std::string, std::unique_ptr<FormulaTemplate>> templates;
+    std::mutex textsLock;  // Separate from lock, text cells are created on several threads too
+    std::unordered_map<std::string_view, std::unique_ptr<CValue>> texts;  // Keys view their values
+};
+
+const FormulaTemplate *TemplatePool::intern(const MyExprBuilder &builder) {
+    const ExprNode *root = builder.getRoot();
+    std::lock_guard<std::mutex> guard(lock);
+    auto slot = templates.try_emplace(builder.getKey());
+    if (slot.second) {
+        // The builder's nodes live in a scratch arena, only new templates are copied over
+        slot.first->second = std::make_unique<FormulaTemplate>(root->clone(arena));
+        slot.first->second->key = slot.first->first;
+    }
+    return slot.first->second.get();
+}
+
+const FormulaTemplate *TemplatePool::intern(const FormulaTemplate &formula) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto slot = templates.try_emplace(std::string(formula.key));
+    if (slot.second) {
+        slot.first->second = std::make_unique<FormulaTemplate>(formula.root->clone(arena));
+        slot.first->second->key = slot.first->first;
+    }
+    return slot.first->second.get();
+}
+
+size_t TemplatePool::size() {
+    std::scoped_lock guard(lock, textsLock);
+    return templates.size() + texts.size();
+}
+
+const CValue *TemplatePool::intern(std::string_view text) {
+    std::lock_guard<std::mutex> guard(textsLock);
+    auto found = texts.find(text);
+    if (found != texts.end()) return found->second.get();
+    auto val = std::make_unique<CValue>(std::string(text));
+    std::string_view key = std::get<std::string>(*val);
+    return texts.emplace(key, std::move(val)).first->second.get();
+}
+
+// Helper function to check if a string is a number
+bool is_number(const std::string &s) {
+    char *end = nullptr;
+    double val = strtod(s.c_str(), &end);
+    return end != s.c_str() && *end == '\0' && val != HUGE_VAL;
+}
+
+// Recursive-descent parser for formulas, reports the expression to the builder in postfix order.
+// Precedence from lowest: = <>, then < <= > >=, then + -, then * /, then unary minus, then ^.
+// Binary operators are left associative. Function names are case-insensitive and take any number
+// of arguments; ranges like A1:B5 may only appear as function arguments.
+class FormulaParser {
+public:
+    FormulaParser(std::string_view text, CExprBuilder &builder) : text(text), builder(builder) {}
+
+    void parse() {
+        if (!accept("=")) fail("Formula must start with =");
+        if (equality()) fail("Range is not a value");
+        skipSpace();
+        if (at != text.size()) fail("Unexpected extra token(s)");
+    }
+
+private:
+    std::string_view text;
+    CExprBuilder &builder;
+    size_t at = 0;
+
+    [[noreturn]] void fail(const std::string &message) const {
+        throw std::invalid_argument(message + " at " + std::to_string(at));
+    }
+
+    void skipSpace() {
+        while (at < text.size() && std::isspace(static_cast<unsigned char>(text[at]))) at++;
+    }
+
+    bool accept(std::string_view token) {
+        skipSpace();
+        if (text.substr(at, token.size()) != token) return false;
+        at += token.size();
+        return true;
+    }
+
+    bool peekDigit() const {
+        return at < text.size() && std::isdigit(static_cast<unsigned char>(text[at]));
+    }
+
+    bool peekLetter() const {
+        return at < text.size() && std::isalpha(static_cast<unsigned char>(text[at]));
+    }
+
+    void value(bool range) const {
+        if (range) fail("Range is not a value");
+    }
+
+    // Each level returns true when it parsed a bare range
+    bool equality() {
+        bool range = relational();
+        while (true) {
+            if (accept("<>")) {
+                value(range);
+                value(relational());
+                builder.opNe();
+            } else if (accept("=")) {
+                value(range);
+                value(relational());
+                builder.opEq();
+            } else return range;
+            range = false;
+        }
+    }
+
+    bool relational() {
+        bool range = additive();
+        while (true) {
+            void (CExprBuilder::*op)();
+            if (accept("<=")) op = &CExprBuilder::opLe;
+            else if (accept(">=")) op = &CExprBuilder::opGe;
+            else if (text.substr(at, 2) != "<>" && accept("<")) op = &CExprBuilder::opLt;
+            else if (accept(">")) op = &CExprBuilder::opGt;
+            else return range;
+            value(range);
+            value(additive());
+            (builder.*op)();
+            range = false;
+        }
+    }
+
+    bool additive() {
+        bool range = multiplicative();
+        while (true) {
+            if (accept("+")) {
+                value(range);
+                value(multiplicative());
+                builder.opAdd();
+            } else if (accept("-")) {
+                value(range);
+                value(multiplicative());
+                builder.opSub();
+            } else return range;
+            range = false;
+        }
+    }
+
+    bool multiplicative() {
+        bool range = unary();
+        while (true) {
+            if (accept("*")) {
+                value(range);
+                value(unary());
+                builder.opMul();
+            } else if (accept("/")) {
+                value(range);
+                value(unary());
+                builder.opDiv();
+            } else return range;
+            range = false;
+        }
+    }
+
+    bool unary() {
+        if (!accept("-")) return power();
+        value(unary());
+        builder.opNeg();
+        return false;
+    }
+
+    bool power() {
+        bool range = primary();
+        while (accept("^")) {
+            value(range);
+            value(primary());
+            builder.opPow();
+            range = false;
+        }
+        return range;
+    }
+
+    bool primary() {
+        skipSpace();
+        if (at == text.size()) fail("Unexpected end of formula");
+        if (accept("(")) {
+            bool range = equality();
+            if (!accept(")")) fail("Missing )");
+            return range;
+        }
+        if (text[at] == '"') {
+            builder.valString(string());
+            return false;
+        }
+        if (peekDigit()) {
+            builder.valNumber(number());
+            return false;
+        }
+        if (text[at] != '$' && !peekLetter()) fail("Unexpected character");
+
+        size_t start = at;
+        bool fixed = text[at] == '$';
+        if (fixed) at++;
+        while (peekLetter()) at++;
+        if (!fixed && at < text.size() && text[at] == '(') {
+            std::string name(text.substr(start, at - start));
+            at++;
+            int count = 0;
+            if (!accept(")")) {
+                do {
+                    equality();
+                    count++;
+                } while (accept(","));
+                if (!accept(")")) fail("Missing )");
+            }
+            builder.funcCall(name, count);
+            return false;
+        }
+        at = start;
+        std::string first = reference();
+        if (at < text.size() && text[at] == ':') {
+            at++;
+            builder.valRange(first + ':' + reference());
+            return true;
+        }
+        builder.valReference(first);
+        return false;
+    }
+
+    // Quoted string, a doubled quote stands for one quote character
+    std::string string() {
+        std::string ret;
+        at++;
+        while (true) {
+            if (at == text.size()) fail("Unterminated string");
+            if (text[at] == '"') {
+                if (at + 1 < text.size() && text[at + 1] == '"') {
+                    ret += '"';
+                    at += 2;
+                    continue;
+                }
+                at++;
+                return ret;
+            }
+            ret += text[at++];
+        }
+    }
+
+    double number() {
+        size_t start = at;
+        while (peekDigit()) at++;
+        if (at < text.size() && text[at] == '.') {
+            at++;
+            while (peekDigit()) at++;
+        }
+        if (at < text.size() && (text[at] == 'e' || text[at] == 'E')) {
+            at++;
+            if (at < text.size() && (text[at] == '+' || text[at] == '-')) at++;
+            if (!peekDigit()) fail("Invalid number");
+            while (peekDigit()) at++;
+        }
+        return std::stod(std::string(text.substr(start, at - start)));
+    }
+
+    // Cell reference like A1 or $AB$12, without surrounding spaces
+    std::string reference() {
+        size_t start = at;
+        if (at < text.size() && text[at] == '$') at++;
+        if (!peekLetter()) fail("Invalid reference");
+        while (peekLetter()) at++;
+        if (at < text.size() && text[at] == '$') at++;
+        if (!peekDigit()) fail("Invalid reference");
+        while (peekDigit()) at++;
+        return std::string(text.substr(start, at - start));
+    }
+};
+
+// Checks a formula the way MyExprBuilder accepts it without building any nodes. A lazy load runs it
+// on every formula it keeps as text, so it fails on the same records as an eager load.
+class FormulaCheck : public CExprBuilder {
+public:
+    // Throws like parsing the formula at origin would
+    static void check(std::string_view text, const CPos &origin) {
+        FormulaCheck check(origin);
+        FormulaParser(text, check).parse();
+        if (check.ranges.size() != 1) throw std::invalid_argument("incorrect input, elements > 1");
+        if (check.ranges.back()) throw std::invalid_argument("Range is not a value");
+    }
+
+    void opAdd() override { binary(); }
+
+    void opSub() override { binary(); }
+
+    void opMul() override { binary(); }
+
+    void opDiv() override { binary(); }
+
+    void opPow() override { binary(); }
+
+    void opNeg() override {
+        if (ranges.empty()) throw std::invalid_argument("Not enough on stack");
+        ranges.back() = false;
+    }
+
+    void opEq() override { binary(); }
+
+    void opNe() override { binary(); }
+
+    void opLt() override { binary(); }
+
+    void opLe() override { binary(); }
+
+    void opGt() override { binary(); }
+
+    void opGe() override { binary(); }
+
+    void valNumber(double) override { ranges.push_back(false); }
+
+    void valString(std::string) override { ranges.push_back(false); }
+
+    void valReference(std::string val) override {
+        (void) Reference(std::move(val), origin);
+        ranges.push_back(false);
+    }
+
+    void valRange(std::string val) override {
+        (void) Range(val, origin);
+        ranges.push_back(true);
+    }
+
+    void funcCall(std::string fnName, int paramCount) override {
+        Function function = functionByName(std::move(fnName));
+        Signature sig = signature(function);
+        if (paramCount < sig.minArgs || paramCount > sig.maxArgs) {
+            throw std::invalid_argument(std::string(functionName(function)) + " takes a different number of arguments");
+        }
+        if (ranges.size() < size_t(paramCount)) throw std::invalid_argument("Not enough on stack");
+        size_t first = ranges.size() - paramCount;
+        for (int i = 0; i < paramCount && i < 32; i++) {
+            if (ranges[first + i] && (sig.values >> i & 1)) throw std::invalid_argument("Range is not a value");
+            if (!ranges[first + i] && (sig.ranges >> i & 1)) throw std::invalid_argument("Argument must be a range");
+        }
+        ranges.resize(first);
+        ranges.push_back(false);
+    }
+
+private:
+    CPos origin;
+    std::vector<bool> ranges;  // Stack of the operands, true for a bare range
+
+    explicit FormulaCheck(const CPos &origin) : origin(origin) {}
+
+    void binary() {
+        if (ranges.size() < 2) throw std::invalid_argument("Not enough on stack");
+        ranges.pop_back();
+        ranges.back() = false;
+    }
+};
+
+// Determines if the input is an expression, string, or number
+cellContents::cellContents(const std::string &input, const CPos &pos, TemplatePool &templates, NodeArena &scratch)
+        : pos(pos) {
+    if (input[0] == '=') {
+        scratch.reset();
+        MyExprBuilder expression(scratch, pos);
+        FormulaParser(input, expression).parse();
+        formula = templates.intern(expression);
+        state = true;
+        return;
+    }
+    state = false;
+    if (!input.empty() && is_number(input)) {
+        val = std::stod(input);
+    } else {
+        text = templates.intern(input);
+    }
+}
+
+cellContents::cellContents(const cellContents &other, const CPos &pos)
+        : state(other.state), val(other.val), text(other.text), formula(other.formula), source(other.source), pos(pos),
+          cyclic(other.cyclic) {
+    if (pos.getColumn() == other.pos.getColumn() && pos.getRow() == other.pos.getRow() &&
+        !other.dirty.load(std::memory_order_acquire)) {
+        // Same position in another sheet, the computed value still holds. A clean cache is no
+        // longer written, while a dirty one may be under evaluation by a reader of the other sheet.
+        cache = other.cache;
+        dirty = false;
+    }
+}
+
+CValue cellContents::getResult(const CellStore &cells) const {
+    return value(cells);
+}
+
+const CValue &cellContents::value(const CellStore &cells) const {
+    static const CValue empty;
+    if (state == false) {
+        return constant();
+    }
+    if (cyclic || formula == nullptr) {
+        return empty;
+    }
+    // Readers evaluate concurrently. The first to claim a dirty cell evaluates it, the others wait
+    // for its result; cycles are flagged beforehand, so no thread waits on a cell it is evaluating.
+    while (dirty.load(std::memory_order_acquire)) {
+        if (busy.exchange(true, std::memory_order_acquire)) {
+            busy.wait(true, std::memory_order_acquire);
+            continue;
+        }
+        try {
+            // Only store the result once evaluation succeeded, a throw leaves the cell dirty
+            if (dirty.load(std::memory_order_relaxed)) {
+                cache = formula->code.run(EvalContext{cells, pos});
+                dirty.store(false, std::memory_order_release);
+            }
+        }
+        catch (...) {
+            busy.store(false, std::memory_order_release);
+            busy.notify_all();
+            throw;
+        }
+        busy.store(false, std::memory_order_release);
+        busy.notify_all();
+    }
+    return cache;
+}
+
+void Bytecode::push(const Instruction &ins, int effect) {
+    code.push_back(ins);
+    numbersOnly = numbersOnly && ins.op != OpCode::String && ins.op != OpCode::Range && ins.op != OpCode::Call;
+    depth += effect;
+    maxDepth = std::max(maxDepth, depth);
+}
+
+void Bytecode::emit(OpCode op) {
+    Instruction ins{op, {}};
+    push(ins, op == OpCode::Neg ? 0 : -1);
+}
+
+void Bytecode::emitNumber(double val) {
+    Instruction ins{OpCode::Number, {}};
+    ins.number = val;
+    push(ins, 1);
+}
+
+void Bytecode::emitString(std::string_view val) {
+    Instruction ins{OpCode::String, {}};
+    ins.string = strings.size();
+    strings.emplace_back(val);
+    push(ins, 1);
+}
+
+void Bytecode::emitReference(const CellOperand &cell) {
+    Instruction ins{OpCode::Reference, {}};
+    ins.cell = cell;
+    push(ins, 1);
+}
+
+void Bytecode::emitRange(const RangeOperand &range) {
+    Instruction ins{OpCode::Range, {}};
+    ins.range = ranges.size();
+    ranges.push_back(range);
+    push(ins, 1);
+}
+
+void Bytecode::emitCall(Function function, int count) {
+    Instruction ins{OpCode::Call, {}};
+    ins.call.function = function;
+    ins.call.count = count;
+    push(ins, 1 - count);
+}
+
+int Bytecode::operands(const Instruction &ins) {
+    switch (ins.op) {
+        case OpCode::Number:
+        case OpCode::String:
+        case OpCode::Reference:
+        case OpCode::Range:
+        case OpCode::Load:
+            return 0;
+        case OpCode::Call:
+            return ins.call.count;
+        case OpCode::Keep:
+        case OpCode::Neg:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+void Bytecode::shareRepeats() {
+    // Encodes the instructions so that equal subexpressions are equal substrings of text. In
+    // postfix order a subexpression is the run of instructions ending with its operator.
+    size_t n = code.size();
+    std::string text;
+    std::vector<size_t> offset(n + 1);
+    std::vector<size_t> start(n);  // First instruction of the subexpression each instruction ends
+    std::vector<size_t> open;
+    auto appendCell = [&text](const CellOperand &cell) {
+        text += std::to_string(cell.column) + (cell.fixedColumn ? "$" : ",") +
+                std::to_string(cell.row) + (cell.fixedRow ? "$" : ",");
+    };
+    for (size_t i = 0; i < n; i++) {
+        const Instruction &ins = code[i];
+        offset[i] = text.size();
+        text += char(ins.op);
+        if (ins.op == OpCode::Number) {
+            text.append(reinterpret_cast<const char *>(&ins.number), sizeof(ins.number));
+        } else if (ins.op == OpCode::String) {
+            text += std::to_string(strings[ins.string].size()) + ':' + strings[ins.string];
+        } else if (ins.op == OpCode::Reference) {
+            appendCell(ins.cell);
+        } else if (ins.op == OpCode::Range) {
+            appendCell(ranges[ins.range].first);
+            appendCell(ranges[ins.range].second);
+        } else if (ins.op == OpCode::Call) {
+            text += std::to_string(int(ins.call.function)) + ',' + std::to_string(ins.call.count) + ';';
+        }
+        size_t first = i;
+        for (int k = operands(ins); k > 0; k--) {
+            first = open.back();
+            open.pop_back();
+        }
+        start[i] = first;
+        open.push_back(first);
+    }
+    offset[n] = text.size();
+
+    // Larger repeats first, so the parts of a replaced repeat are not shared on their own.
+    // Of the single operands only cell reads cost more than keeping their value.
+    std::vector<size_t> order;
+    for (size_t i = 0; i < n; i++) {
+        if (i - start[i] >= 2 || code[i].op == OpCode::Reference) order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&start](size_t a, size_t b) {
+        return a - start[a] > b - start[b];
+    });
+    std::vector<bool> dropped(n);
+    std::vector<int> keep(n, -1), load(n, -1);
+    std::unordered_map<std::string_view, size_t> earliest;
+    for (size_t i: order) {
+        if (dropped[i]) continue;
+        auto [found, added] = earliest.emplace(
+                std::string_view(text).substr(offset[start[i]], offset[i + 1] - offset[start[i]]), i);
+        if (added) continue;
+        if (keep[found->second] < 0) keep[found->second] = locals++;
+        load[i] = keep[found->second];
+        for (size_t k = start[i]; k <= i; k++) dropped[k] = true;
+    }
+    if (locals == 0) return;
+
+    std::vector<Instruction> old = std::move(code);
+    code.clear();
+    depth = maxDepth = 0;
+    for (size_t i = 0; i < n; i++) {
+        Instruction ins = old[i];
+        if (load[i] >= 0) {
+            ins = {OpCode::Load, {}};
+            ins.local = load[i];
+        } else if (dropped[i]) {
+            continue;
+        }
+        push(ins, 1 - operands(ins));
+        if (keep[i] >= 0) {
+            Instruction kept{OpCode::Keep, {}};
+            kept.local = keep[i];
+            push(kept, 0);
+        }
+    }
+}
+
+bool Bytecode::runNumbers(const EvalContext &ctx, CValue &result) const {
+    // Every operation left gives an empty result for an empty operand or a division by zero,
+    // so the first of those decides the whole formula
+    double local[16];
+    std::vector<double> heap;
+    double *stack = local;
+    if (maxDepth + locals > 16) {
+        heap.resize(maxDepth + locals);
+        stack = heap.data();
+    }
+    double *kept = stack + maxDepth;
+    int top = 0;
+
+    for (const auto &ins: code) {
+        switch (ins.op) {
+            case OpCode::Number:
+                stack[top++] = ins.number;
+                break;
+            case OpCode::Reference: {
+                const cellContents *cell = ctx.cells.find(ins.cell.resolve(ctx.origin));
+                if (cell == nullptr) {
+                    result = CValue();
+                    return true;
+                }
+                const CValue &val = cell->value(ctx.cells);
+                if (auto number = std::get_if<double>(&val)) {
+                    stack[top++] = *number;
+                    break;
+                }
+                if (std::holds_alternative<std::string>(val)) return false;
+                result = CValue();
+                return true;
+            }
+            case OpCode::Keep:
+                kept[ins.local] = stack[top - 1];
+                break;
+            case OpCode::Load:
+                stack[top++] = kept[ins.local];
+                break;
+            case OpCode::Neg:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case OpCode::Add:
+                top--;
+                stack[top - 1] += stack[top];
+                break;
+            case OpCode::Sub:
+                top--;
+                stack[top - 1] -= stack[top];
+                break;
+            case OpCode::Mul:
+                top--;
+                stack[top - 1] *= stack[top];
+                break;
+            case OpCode::Div:
+                top--;
+                if (stack[top] == 0) {
+                    result = CValue();
+                    return true;
+                }
+                stack[top - 1] /= stack[top];
+                break;
+            case OpCode::Pow:
+                top--;
+                stack[top - 1] = std::pow(stack[top - 1], stack[top]);
+                break;
+            case OpCode::String:
+            case OpCode::Range:
+            case OpCode::Call:
+                return false;  // Not in a numbersOnly program
+            default:
+                // Comparisons
+                top--;
+                stack[top - 1] = compare(ins.op, stack[top - 1], stack[top]);
+                break;
+        }
+    }
+    result = stack[0];
+    return true;
+}
+
+void Bytecode::loadColumn(const EvalContext &ctx, const CellOperand &cell, int row, int n, double *values,
+                          unsigned char *flags) {
+    auto read = [&ctx](const cellContents *operand, double &value) -> unsigned char {
+        if (operand == nullptr) return ROW_BLANK;
+        const CValue &val = operand->value(ctx.cells);
+        if (auto number = std::get_if<double>(&val)) {
+            value = *number;
+            return 0;
+        }
+        return std::holds_alternative<std::string>(val) ? ROW_MIXED : ROW_BLANK;
+    };
+    CPos first = cell.resolve(CPos(ctx.origin.getColumn(), row));
+    if (cell.fixedRow) {
+        // Every row reads the same cell
+        double value = 0;
+        unsigned char flag = read(ctx.cells.find(first), value);
+        std::fill_n(values, n, value);
+        for (int i = 0; i < n; i++) flags[i] |= flag;
+        return;
+    }
+    ctx.cells.loadColumn(first.getColumn(), first.getRow(), n, values, [&](int i, const cellContents *operand) {
+        flags[i] |= read(operand, values[i]);
+    });
+}
+
+void Bytecode::runColumn(const EvalContext &ctx, int count, double *results, unsigned char *flags) const {
+    // Blocks small enough for all operand columns to stay in the cache
+    constexpr int BLOCK = 256;
+    std::vector<double> columns(size_t(maxDepth + locals) * BLOCK);
+    auto column = [&](int slot) { return columns.data() + size_t(slot) * BLOCK; };
+
+    for (int first = 0; first < count; first += BLOCK) {
+        int n = std::min(BLOCK, count - first);
+        int row = ctx.origin.getRow() + first;
+        unsigned char *flag = flags + first;
+        std::fill_n(flag, n, 0);
+        int top = 0;
+        for (const auto &ins: code) {
+            switch (ins.op) {
+                case OpCode::Number:
+                    std::fill_n(column(top++), n, ins.number);
+                    break;
+                case OpCode::Reference:
+                    loadColumn(ctx, ins.cell, row, n, column(top++), flag);
+                    break;
+                case OpCode::Keep:
+                    std::copy_n(column(top - 1), n, column(maxDepth + ins.local));
+                    break;
+                case OpCode::Load:
+                    std::copy_n(column(maxDepth + ins.local), n, column(top++));
+                    break;
+                case OpCode::Neg: {
+                    double *vals = column(top - 1);
+                    for (int i = 0; i < n; i++) vals[i] = -vals[i];
+                    break;
+                }
+                case OpCode::Add:
+                    top--;
+                    combine(column(top - 1), column(top), n, std::plus<>());
+                    break;
+                case OpCode::Sub:
+                    top--;
+                    combine(column(top - 1), column(top), n, std::minus<>());
+                    break;
+                case OpCode::Mul:
+                    top--;
+                    combine(column(top - 1), column(top), n, std::multiplies<>());
+                    break;
+                case OpCode::Div: {
+                    top--;
+                    const double *divisors = column(top);
+                    for (int i = 0; i < n; i++) flag[i] |= divisors[i] == 0 ? ROW_BLANK : 0;
+                    combine(column(top - 1), divisors, n, std::divides<>());
+                    break;
+                }
+                case OpCode::Pow:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return std::pow(l, r); });
+                    break;
+                case OpCode::Eq:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return double(l == r); });
+                    break;
+                case OpCode::Ne:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return double(l != r); });
+                    break;
+                case OpCode::Lt:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return double(l < r); });
+                    break;
+                case OpCode::Le:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return double(l <= r); });
+                    break;
+                case OpCode::Gt:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return double(l > r); });
+                    break;
+                case OpCode::Ge:
+                    top--;
+                    combine(column(top - 1), column(top), n, [](double l, double r) { return double(l >= r); });
+                    break;
+                default:
+                    // Strings, ranges and calls are not in a numeric program, the rows run on their own
+                    std::fill_n(flags, count, ROW_MIXED);
+                    return;
+            }
+        }
+        std::copy_n(column(0), n, results + first);
+    }
+}
+
+CValue Bytecode::run(const EvalContext &ctx) const {
+    CValue result;
+    if (numbersOnly && runNumbers(ctx, result)) return result;
+
+    // Short formulas fit in the local buffer, deeper ones fall back to the heap. Kept values
+    // follow the stack.
+    Slot local[16];
+    std::vector<Slot> heap;
+    Slot *stack = local;
+    if (maxDepth + locals > 16) {
+        heap.resize(maxDepth + locals);
+        stack = heap.data();
+    }
+    Slot *kept = stack + maxDepth;
+    std::list<std::string> temps;  // Strings produced while running, e.g. concatenations
+    int top = 0;
+
+    for (const auto &ins: code) {
+        switch (ins.op) {
+            case OpCode::Number:
+                stack[top++] = {Slot::Number, ins.number, nullptr};
+                break;
+            case OpCode::String:
+                stack[top++] = {Slot::Text, 0, &strings[ins.string]};
+                break;
+            case OpCode::Reference: {
+                const cellContents *cell = ctx.cells.find(ins.cell.resolve(ctx.origin));
+                if (cell == nullptr) stack[top++] = {Slot::Empty, 0, nullptr};
+                else stack[top++] = Slot::load(cell->value(ctx.cells), cell->text != nullptr);
+                break;
+            }
+            case OpCode::Range:
+                stack[top].kind = Slot::Range;
+                stack[top++].range = &ranges[ins.range];
+                break;
+            case OpCode::Call:
+                top -= ins.call.count - 1;
+                stack[top - 1] = call(ins.call.function, &stack[top - 1], ins.call.count, ctx, temps);
+                break;
+            case OpCode::Keep:
+                kept[ins.local] = stack[top - 1];
+                break;
+            case OpCode::Load:
+                stack[top++] = kept[ins.local];
+                break;
+            case OpCode::Neg:
+                if (stack[top - 1].kind == Slot::Number) stack[top - 1].number = -stack[top - 1].number;
+                else stack[top - 1].kind = Slot::Empty;
+                break;
+            case OpCode::Add:
+                top--;
+                if (stack[top - 1].kind == Slot::Number && stack[top].kind == Slot::Number) {
+                    stack[top - 1].number += stack[top].number;
+                } else {
+                    mixed(ins.op, stack[top - 1], stack[top], temps);
+                }
+                break;
+            case OpCode::Sub:
+                top--;
+                if (stack[top - 1].kind == Slot::Number && stack[top].kind == Slot::Number) {
+                    stack[top - 1].number -= stack[top].number;
+                } else {
+                    mixed(ins.op, stack[top - 1], stack[top], temps);
+                }
+                break;
+            case OpCode::Mul:
+                top--;
+                if (stack[top - 1].kind == Slot::Number && stack[top].kind == Slot::Number) {
+                    stack[top - 1].number *= stack[top].number;
+                } else {
+                    mixed(ins.op, stack[top - 1], stack[top], temps);
+                }
+                break;
+            case OpCode::Div:
+                top--;
+                if (stack[top - 1].kind == Slot::Number && stack[top].kind == Slot::Number && stack[top].number != 0) {
+                    stack[top - 1].number /= stack[top].number;
+                } else {
+                    mixed(ins.op, stack[top - 1], stack[top], temps);
+                }
+                break;
+            case OpCode::Pow:
+                top--;
+                if (stack[top - 1].kind == Slot::Number && stack[top].kind == Slot::Number) {
+                    stack[top - 1].number = std::pow(stack[top - 1].number, stack[top].number);
+                } else {
+                    mixed(ins.op, stack[top - 1], stack[top], temps);
+                }
+                break;
+            default:
+                // Comparisons
+                top--;
+                if (stack[top - 1].kind == Slot::Number && stack[top].kind == Slot::Number) {
+                    stack[top - 1].number = compare(ins.op, stack[top - 1].number, stack[top].number);
+                } else {
+                    mixed(ins.op, stack[top - 1], stack[top], temps);
+                }
+                break;
+        }
+    }
+    if (top == 0) return CValue();
+    return stack[0].value();
+}
+
+template<typename T>
+bool Bytecode::compare(OpCode op, const T &l, const T &r) {
+    switch (op) {
+        case OpCode::Eq: return l == r;
+        case OpCode::Ne: return l != r;
+        case OpCode::Lt: return l < r;
+        case OpCode::Le: return l <= r;
+        case OpCode::Gt: return l > r;
+        default: return l >= r;
+    }
+}
+
+void Bytecode::mixed(OpCode op, Slot &l, const Slot &r, std::list<std::string> &temps) {
+    // Operands that are not both numbers, or a division by zero
+    if (l.kind == Slot::Empty || r.kind == Slot::Empty) {
+        l.kind = Slot::Empty;
+    } else if (op == OpCode::Add) {
+        // Concatenates straight from the operands, the string comes first as in addValues
+        std::string &text = temps.emplace_back(l.kind == Slot::Text ? *l.text : *r.text);
+        if (l.kind == Slot::Text && r.kind == Slot::Text) text += *r.text;
+        else text += std::to_string(l.kind == Slot::Number ? l.number : r.number);
+        l = {Slot::Text, 0, &text};
+    } else if (op >= OpCode::Eq && l.kind == Slot::Text && r.kind == Slot::Text) {
+        // Interned strings are equal exactly when they are the same string, only their order
+        // and strings from elsewhere need the bytes
+        if (l.text == r.text) {
+            l = {Slot::Number, double(compare(op, 0, 0)), nullptr};
+        } else if (l.interned && r.interned && (op == OpCode::Eq || op == OpCode::Ne)) {
+            l = {Slot::Number, double(op == OpCode::Ne), nullptr};
+        } else {
+            l = {Slot::Number, double(compare(op, *l.text, *r.text)), nullptr};
+        }
+    } else {
+        l.kind = Slot::Empty;
+    }
+}
+
+Bytecode::Slot Bytecode::call(Function function, const Slot *args, int count, const EvalContext &ctx,
+                              std::list<std::string> &temps) {
+    if (function == Function::If) {
+        if (args[0].kind != Slot::Number) return {Slot::Empty, 0, nullptr};
+        return args[0].number != 0 ? args[1] : args[2];
+    }
+    if (function >= Function::CountIf) {
+        Argument values[6];
+        for (int i = 0; i < count; i++) {
+            if (args[i].kind == Slot::Range) values[i] = {true, args[i].range->resolve(ctx.origin), {}};
+            else values[i] = {false, {}, args[i].value()};
+        }
+        CValue result = callOnRanges(function, values, count, ctx.cells);
+        if (auto text = std::get_if<std::string>(&result)) {
+            temps.push_back(std::move(*text));
+            return {Slot::Text, 0, &temps.back()};
+        }
+        return Slot::load(result);
+    }
+    if (function == Function::CountVal) {
+        CValue target = args[0].value();
+        double matches = 0;
+        for (int i = 1; i < count; i++) {
+            if (args[i].kind == Slot::Range) {
+                matches += countMatches(target, ctx.cells, args[i].range->resolve(ctx.origin));
+            } else {
+                matches += compareValues(target, args[i].value(), std::equal_to<>()) == CValue(1.0);
+            }
+        }
+        return {Slot::Number, matches, nullptr};
+    }
+    Aggregate aggregate;
+    for (int i = 0; i < count; i++) {
+        if (args[i].kind == Slot::Range) aggregate.addRange(ctx.cells, args[i].range->resolve(ctx.origin));
+        else if (args[i].kind == Slot::Number) aggregate.add(args[i].number);
+        else if (args[i].kind == Slot::Text) aggregate.values++;
+    }
+    CValue result = aggregate.result(function);
+    if (std::holds_alternative<double>(result)) return {Slot::Number, std::get<double>(result), nullptr};
+    return {Slot::Empty, 0, nullptr};
+}
+
+void cellContents::store(CValue result) const {
+    if (!dirty.load(std::memory_order_acquire) || busy.exchange(true, std::memory_order_acquire)) return;
+    if (dirty.load(std::memory_order_relaxed)) {
+        cache = std::move(result);
+        dirty.store(false, std::memory_order_release);
+    }
+    busy.store(false, std::memory_order_release);
+    busy.notify_all();
+}
+
+Precedents cellContents::references() const {
+    Precedents ret;
+    if (formula) formula->root->references(pos, ret);  // Nothing is known about an unparsed formula
+    return ret;
+}
+
+// Ranges read from one column and the positions reading them, in a centered interval tree over the
+// rows. A range lives in the node of the highest bit in which its first and last row differ, so it
+// contains the center row of that node. A row visits one node per level and there reads, in order
+// of their first or last row, only the ranges that reach it; the other ranges are never tested.
+// Each range keeps its readers together, so a range read by many cells is still one entry.
+class RangeLinks {
+public:
+    void add(const CRange &range, const CPos &dep) {
+        auto [level, key] = node(range);
+        Node &node = nodes[key];
+        auto readers = node.byFrom.try_emplace(range);
+        if (readers.second) {
+            node.byTo.insert(range);
+            counts[level]++;
+        }
+        readers.first->second.insert(dep);
+    }
+
+    // Removes the link, repeated removals of the same one do nothing
+    void remove(const CRange &range, const CPos &dep) {
+        auto [level, key] = node(range);
+        auto found = nodes.find(key);
+        if (found == nodes.end()) return;
+        auto readers = found->second.byFrom.find(range);
+        if (readers == found->second.byFrom.end() || !readers->second.erase(dep) || !readers->second.empty()) return;
+        found->second.byFrom.erase(readers);
+        found->second.byTo.erase(range);
+        if (found->second.byFrom.empty()) nodes.erase(found);
+        counts[level]--;
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Calls fn(range, readers) once for every range containing the row of pos
+    template<typename Fn>
+    void forEachRangeContaining(const CPos &pos, Fn fn) const {
+        uint64_t row = rowKey(pos.getRow());
+        for (int level = 0; level < LEVELS; level++) {
+            if (counts[level] == 0) continue;
+            auto found = nodes.find(nodeKey(level, row));
+            if (found == nodes.end()) continue;
+            const Node &node = found->second;
+            uint64_t center = level ? (row >> level << level) | uint64_t(1) << (level - 1) : row;
+            if (row < center) {
+                // Every range here ends at or after the center, the ones starting by row contain it
+                for (auto range = node.byFrom.begin(); range != node.byFrom.end() &&
+                                                       range->first.from.getRow() <= pos.getRow(); ++range) {
+                    fn(range->first, range->second);
+                }
+            } else {
+                // Every range here starts before the center, the ones ending at or after row contain it
+                for (auto range = node.byTo.begin(); range != node.byTo.end() &&
+                                                     range->to.getRow() >= pos.getRow(); ++range) {
+                    fn(*range, node.byFrom.find(*range)->second);
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr int LEVELS = 33;  // Rows are 32 bits, a range of a single row is level 0
+
+    // Orders by the first row, the rest only keeps distinct ranges apart
+    struct ByFrom {
+        bool operator()(const CRange &l, const CRange &r) const {
+            return std::tuple(l.from.getRow(), l.to.getRow(), l.from.getColumn(), l.to.getColumn()) <
+                   std::tuple(r.from.getRow(), r.to.getRow(), r.from.getColumn(), r.to.getColumn());
+        }
+    };
+
+    // Orders by the last row, the latest first
+    struct ByTo {
+        bool operator()(const CRange &l, const CRange &r) const {
+            return std::tuple(r.to.getRow(), l.from.getRow(), l.from.getColumn(), l.to.getColumn()) <
+                   std::tuple(l.to.getRow(), r.from.getRow(), r.from.getColumn(), r.to.getColumn());
+        }
+    };
+
+    struct Node {
+        std::map<CRange, std::set<CPos>, ByFrom> byFrom;  // Readers of each range
+        std::set<CRange, ByTo> byTo;  // The same ranges
+    };
+
+    std::unordered_map<uint64_t, Node> nodes;
+    std::array<int, LEVELS> counts{};  // Ranges per level, empty levels are skipped
+
+    // Maps a row to an unsigned key of the same order
+    static uint64_t rowKey(int row) {
+        return uint32_t(row) ^ 0x80000000u;
+    }
+
+    static uint64_t nodeKey(int level, uint64_t row) {
+        return uint64_t(level) << 32 | row >> level;
+    }
+
+    static std::pair<int, uint64_t> node(const CRange &range) {
+        uint64_t from = rowKey(range.from.getRow()), to = rowKey(range.to.getRow());
+        int level = std::bit_width(from ^ to);
+        return {level, nodeKey(level, to)};
+    }
+};
+
+// Runs dependency-ordered tasks on a fixed set of threads. Every worker owns a
+// deque it pushes to and pops from at the back; idle workers steal from the front of others, and
+// wait without spinning while every deque is empty.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads) : queues(std::max(threads, 1u)) {}
+
+    // Runs the initial tasks and everything they push until total tasks have finished.
+    // task(id, push) is called once per task, push(id) schedules a newly ready task.
+    template<typename Task>
+    void run(const std::vector<int> &initial, size_t total, Task task) {
+        for (size_t i = 0; i < initial.size(); i++) {
+            queues[i % queues.size()].tasks.push_back(initial[i]);
+        }
+        finished = 0;
+        events = 0;
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < queues.size(); i++) {
+            workers.emplace_back([this, i, total, &task]() { work(i, total, task); });
+        }
+        work(0, total, task);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::atomic<size_t> finished;
+    std::atomic<unsigned> events;  // Bumped on every push and on the end of the run, idle workers wait on it
+
+    template<typename Task>
+    void work(size_t self, size_t total, Task &task) {
+        auto push = [this, self](int id) {
+            {
+                std::lock_guard<std::mutex> guard(queues[self].lock);
+                queues[self].tasks.push_back(id);
+            }
+            events.fetch_add(1, std::memory_order_release);
+            events.notify_one();
+        };
+        while (finished.load(std::memory_order_acquire) < total) {
+            // Read before looking at the deques, a push after that changes it and wakes the wait
+            unsigned seen = events.load(std::memory_order_acquire);
+            int id;
+            if (!take(self, id)) {
+                if (finished.load(std::memory_order_acquire) < total) events.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+            task(id, push);
+            if (finished.fetch_add(1, std::memory_order_acq_rel) + 1 == total) {
+                events.fetch_add(1, std::memory_order_release);
+                events.notify_all();
+            }
+        }
+    }
+
+    bool take(size_t self, int &id) {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].tasks.empty()) {
+                id = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue &victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                id = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Read-only memory map of a whole file, empty if the file cannot be mapped
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                bytes = static_cast<const char *>(map);
+                length = info.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (bytes) munmap(const_cast<char *>(bytes), length);
+    }
+
+    const char *data() const { return bytes; }
+
+    size_t size() const { return length; }
+
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+};
+
+// Binary snapshot of a sheet: header, tile directory, string pool, formula templates, tiles.
+// Integers and doubles are stored in the byte order of the machine. The pool and the templates are
+// tables of end offsets followed by their bytes, so any entry is found without reading the others.
+// A template is the text of the formula at the position of the first cell using it, parsed once on
+// load and shared by all its cells. A tile holds its cell count, one 8-byte payload per cell (the
+// raw double, or an index into the pool or the templates), then the cells' slots (column * 64 + row)
+// and kinds, padded to 8 bytes.
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t tiles;  // Entries of the directory, which follows the header
+    uint64_t strings, stringsAt;  // Entries and offset of the string pool
+    uint64_t templates, templatesAt;  // Entries and offset of the templates
+    uint64_t size;  // Length of the whole snapshot
+};
+
+struct SnapshotTile {
+    int32_t col, row;  // Tile coordinates, the position divided by the tile size
+    uint64_t at;  // Offset of the tile's cells
+};
+
+enum class SnapshotKind : uint8_t {
+    Number, String, Formula, Empty
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', '1'};
+
+class CSpreadsheet {
+public:
+    static unsigned capabilities() {
+        return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS | SPREADSHEET_FILE_IO | SPREADSHEET_SPEED |
+               SPREADSHEET_PARSER;
+    }
+
+    CSpreadsheet() = default;
+
+    // Assignment operator, shares the contents with other like the copy constructor
+    CSpreadsheet &operator=(const CSpreadsheet &other) {
+        if (this == &other) return *this;
+        while (true) {
+            other.readLock(nullptr).unlock();  // Applies the queue of a batch other is in the middle of
+            std::unique_lock<std::shared_mutex> writing(lock, std::defer_lock);
+            std::shared_lock<std::shared_mutex> reading(other.lock, std::defer_lock);
+            std::lock(writing, reading);
+            if (!other.queued.empty()) continue;  // Queued again in between
+            share(other);
+            return *this;
+        }
+    }
+
+    // Copies in O(1): the copy shares the cells, their tiles and the dependency links with other, and
+    // a write to either sheet clones only the tiles, cells and link shards it touches. Formula
+    // templates are immutable and shared for good, as are the texts of unparsed formulas. A copy
+    // of a sheet in the middle of a batch gets the contents so far, other's queued setCell calls are
+    // applied first and a parse failure among them is still reported by other's commit.
+    CSpreadsheet(const CSpreadsheet &other) {
+        std::shared_lock<std::shared_mutex> reading = other.readLock(nullptr);
+        share(other);
+    }
+
+    // Takes over the batch other is in the middle of, if any
+    CSpreadsheet(CSpreadsheet &&other) noexcept {
+        std::unique_lock<std::shared_mutex> writing(other.lock);
+        share(other);
+        queued = std::move(other.queued);
+        batching = other.batching;
+        queuedFailed = other.queuedFailed;
+        other.reset();
+        other.batching = false;
+    }
+
+    // Loads the spreadsheet from a stream, parsing the records on the given number of threads. A lazy
+    // load keeps formulas as text and parses each one the first time it is evaluated, or all of them
+    // once the sheet is modified or recalculated. It still checks the syntax of every formula, so it
+    // fails on the same records as an eager load.
+    bool load(std::istream &is, bool lazy = false, unsigned threads = std::thread::hardware_concurrency()) {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        reset();
+        bool ret;
+        try {
+            ret = readRecords(is, lazy, threads);
+        }
+        catch (...) {
+            ret = false;
+        }
+        if (lazy) pending = true;
+        else updateAll();
+        changes.clear();
+        return ret;
+    }
+
+    // Saves the spreadsheet to a stream. Records are appended to one growing buffer that goes to the
+    // stream in large pieces, numbers are written as their shortest text that reads back exactly.
+    bool save(std::ostream &os) const {
+        std::shared_lock<std::shared_mutex> reading = readLock(nullptr);
+        return write(os);
+    }
+
+    // Appends the cells changed since the last saveChanges, compact or load to a journal, in the
+    // format of save. An erased cell is written as (POS;;). Loading the last full save and then
+    // replaying the journal restores the sheet, so the cost of an autosave follows the edits
+    // instead of the size of the sheet.
+    bool saveChanges(std::ostream &journal) {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        applyQueued();
+        if (!journal) return false;
+        std::sort(changes.begin(), changes.end());
+        changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+        std::string out, body;
+        for (const auto &pos: changes) {
+            appendRecord(out, body, pos, array.find(pos));
+        }
+        journal.write(out.data(), out.size());
+        if (!journal) return false;
+        changes.clear();
+        return true;
+    }
+
+    // Saves the whole spreadsheet like save and starts a new journal, the old one is no longer needed.
+    // Also drops the formulas and strings no cell uses any more, see TemplatePool.
+    bool compact(std::ostream &os) {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        applyQueued();
+        if (!write(os)) return false;
+        changes.clear();
+        compactTemplates();
+        return true;
+    }
+
+    // Applies a journal written by saveChanges on top of the current contents. The replayed cells
+    // are already persisted, so they do not count as changes for the next saveChanges.
+    bool replay(std::istream &journal) {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        applyQueued();
+        parsePending();
+        size_t before = changes.size();
+        bool ret;
+        try {
+            ret = readRecords(journal, false, std::thread::hardware_concurrency());
+        }
+        catch (...) {
+            ret = false;
+        }
+        std::vector<CPos> changed(changes.begin() + before, changes.end());
+        changes.resize(before);
+        update(changed);
+        return ret;
+    }
+
+    // Writes a binary snapshot of the spreadsheet, see SnapshotHeader
+    bool saveSnapshot(std::ostream &os) const {
+        std::shared_lock<std::shared_mutex> reading = readLock(nullptr);
+        if (!os) return false;
+        std::vector<SnapshotTile> directory;
+        std::string tiles, strings, templates;
+        std::vector<uint64_t> stringEnds, templateEnds;
+        std::unordered_map<const CValue *, uint32_t> stringIds;  // Interned, one entry per distinct string
+        std::unordered_map<const FormulaTemplate *, uint32_t> templateIds;
+        std::vector<const cellContents *> tile;
+
+        auto flush = [&]() {
+            if (tile.empty()) return;
+            const CPos &first = tile.front()->pos;
+            directory.push_back({first.getColumn() >> CellStore::TILE_BITS, first.getRow() >> CellStore::TILE_BITS,
+                                 tiles.size()});
+            std::string slots, kinds;
+            appendRaw(tiles, uint64_t(tile.size()));
+            for (const cellContents *cell: tile) {
+                uint64_t payload = 0;
+                SnapshotKind kind = SnapshotKind::Empty;
+                if (cell->state) {
+                    kind = SnapshotKind::Formula;
+                    // An unparsed formula gets a template of its own
+                    auto id = cell->formula ? templateIds.try_emplace(cell->formula, templateEnds.size())
+                                            : std::pair(templateIds.end(), true);
+                    if (id.second) {
+                        appendRaw(templates, int32_t(cell->pos.getColumn()));
+                        appendRaw(templates, int32_t(cell->pos.getRow()));
+                        templates += cell->formula ? cell->formula->root->toString(cell->pos, true) : cell->source;
+                        templateEnds.push_back(templates.size());
+                    }
+                    payload = cell->formula ? id.first->second : templateEnds.size() - 1;
+                } else if (auto number = std::get_if<double>(&cell->val)) {
+                    kind = SnapshotKind::Number;
+                    std::memcpy(&payload, number, sizeof(payload));
+                } else if (cell->text) {
+                    kind = SnapshotKind::String;
+                    auto id = stringIds.try_emplace(cell->text, stringIds.size());
+                    if (id.second) {
+                        strings += std::get<std::string>(*cell->text);
+                        stringEnds.push_back(strings.size());
+                    }
+                    payload = id.first->second;
+                }
+                appendRaw(tiles, payload);
+                appendRaw(slots, uint16_t((cell->pos.getColumn() & (CellStore::TILE_SIZE - 1)) * CellStore::TILE_SIZE +
+                                          (cell->pos.getRow() & (CellStore::TILE_SIZE - 1))));
+                kinds += char(kind);
+            }
+            tiles += slots;
+            tiles += kinds;
+            tiles.resize((tiles.size() + 7) & ~size_t(7));
+            tile.clear();
+        };
+        array.forEach([&](const cellContents &cell) {
+            if (cell.broken()) return;
+            // Cells come tile by tile, a change of tile coordinates ends the current one
+            if (!tile.empty() && ((tile.front()->pos.getColumn() ^ cell.pos.getColumn()) >> CellStore::TILE_BITS ||
+                                  (tile.front()->pos.getRow() ^ cell.pos.getRow()) >> CellStore::TILE_BITS)) {
+                flush();
+            }
+            tile.push_back(&cell);
+        });
+        flush();
+
+        SnapshotHeader header{};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.tiles = directory.size();
+        header.strings = stringEnds.size();
+        header.stringsAt = sizeof(header) + directory.size() * sizeof(SnapshotTile);
+        uint64_t stringsSize = (stringEnds.size() * sizeof(uint64_t) + strings.size() + 7) & ~uint64_t(7);
+        header.templates = templateEnds.size();
+        header.templatesAt = header.stringsAt + stringsSize;
+        uint64_t templatesSize = (templateEnds.size() * sizeof(uint64_t) + templates.size() + 7) & ~uint64_t(7);
+        uint64_t tilesAt = header.templatesAt + templatesSize;
+        header.size = tilesAt + tiles.size();
+        for (auto &entry: directory) entry.at += tilesAt;
+
+        std::string head;
+        appendRaw(head, header);
+        head.append(reinterpret_cast<const char *>(directory.data()), directory.size() * sizeof(SnapshotTile));
+        head.append(reinterpret_cast<const char *>(stringEnds.data()), stringEnds.size() * sizeof(uint64_t));
+        head += strings;
+        head.resize(header.templatesAt);
+        head.append(reinterpret_cast<const char *>(templateEnds.data()), templateEnds.size() * sizeof(uint64_t));
+        head += templates;
+        head.resize(tilesAt);
+        os.write(head.data(), head.size());
+        os.write(tiles.data(), tiles.size());
+        return bool(os);
+    }
+
+    // Replaces the spreadsheet with a snapshot written by saveSnapshot
+    bool loadSnapshot(const std::string &path) {
+        return loadSnapshot(path, CPos(0, 0), CPos(std::numeric_limits<int>::max(), std::numeric_limits<int>::max()));
+    }
+
+    // Replaces the spreadsheet with the cells of a snapshot inside the rectangle from..to. The file is
+    // memory mapped and only the tiles overlapping the rectangle are read.
+    bool loadSnapshot(const std::string &path, const CPos &from, const CPos &to) {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        reset();
+        MappedFile file(path);
+        bool ret;
+        try {
+            ret = file.data() && readSnapshot(file.data(), file.size(), CRange{from, to});
+        }
+        catch (...) {
+            ret = false;
+        }
+        updateAll();
+        changes.clear();
+        return ret;
+    }
+
+    // Sets the contents of a cell. Inside a batch the contents are only queued and parsed together
+    // with the rest of the batch, a cell that does not parse then stays unchanged and commit reports it.
+    bool setCell(CPos pos, std::string contents) {
+        if (contents.empty()) return false;
+        std::unique_lock<std::shared_mutex> writing(lock);
+        if (batching) {
+            queued.emplace_back(pos, std::move(contents));
+            return true;
+        }
+        applyQueued();
+        parsePending();
+        try {
+            auto cell = std::make_unique<cellContents>(contents, pos, *templates, scratch);
+            putCell(pos, std::move(cell));
+        }
+        catch (...) {
+            return false;
+        }
+        update({pos});
+        return true;
+    }
+
+    // Sets many cells at once, parsing them on the given number of threads and updating the
+    // dependencies once. Cells whose contents do not parse stay unchanged and make it return false.
+    bool setCells(const std::vector<std::pair<CPos, std::string>> &contents,
+                  unsigned threads = std::thread::hardware_concurrency()) {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        applyQueued();
+        std::vector<CPos> changed;
+        bool ret = putContents(contents, threads, changed);
+        if (batching) batched.insert(batched.end(), changed.begin(), changed.end());
+        else refresh(changed);
+        return ret;
+    }
+
+    // Starts a batch: setCell only queues the contents, which commit parses in parallel and links
+    // in one pass, and the cells setCells and copyRect store get their dependents marked dirty and
+    // their cycles flagged once at commit. Reading the sheet applies the batch so far.
+    void beginBatch() {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        batching = true;
+        queuedFailed = false;
+    }
+
+    // Ends a batch and updates everything changed since beginBatch. Returns false if the contents
+    // of a setCell call in the batch did not parse, that cell stays unchanged.
+    bool commit() {
+        std::unique_lock<std::shared_mutex> writing(lock);
+        flushBatch();
+        batching = false;
+        bool ret = !queuedFailed;
+        queuedFailed = false;
+        return ret;
+    }
+
+    // Gets the value of a cell. Any number of threads may read at once while no writer modifies the
+    // sheet. A read that finds a batch to apply or formulas to parse first does that as a writer,
+    // see prepare.
+    CValue getValue(CPos pos) const {
+        std::shared_lock<std::shared_mutex> reading = readLock(&pos);
+        const cellContents *cell = array.find(pos);
+        if (cell == nullptr) {
+            return CValue();
+        }
+        if (cell->cyclic) {
+            return CValue();
+        }
+        try {
+            evaluate(pos);
+            return cell->getResult(array);
+        }
+        catch (...) {
+            return CValue();
+        }
+    }
+
+    // Evaluates every dirty cell so later getValue calls only read cached values.
+    // Cells whose precedents are all up to date run in parallel on the given number of threads.
+    // Evaluating only takes the read lock, so getValue calls go on meanwhile.
+    void recalculate(unsigned threads = std::thread::hardware_concurrency()) {
+        {
+            std::unique_lock<std::shared_mutex> writing(lock);
+            parsePending();
+            flushBatch();
+        }
+        std::shared_lock<std::shared_mutex> reading(lock);
+        // Numbered column by column, so cells below each other get consecutive ids
+        std::vector<std::pair<CPos, const cellContents *>> sorted;
+        array.forEachFormula([&](const cellContents &cell) {
+            if (cell.dirty && !cell.cyclic) sorted.emplace_back(cell.pos, &cell);
+        });
+        std::sort(sorted.begin(), sorted.end(), [](const auto &l, const auto &r) { return l.first < r.first; });
+        std::vector<CPos> ids;  // Position of each node, sorted
+        std::vector<const cellContents *> nodes;
+        ids.reserve(sorted.size());
+        nodes.reserve(sorted.size());
+        for (const auto &[pos, cell]: sorted) {
+            ids.push_back(pos);
+            nodes.push_back(cell);
+        }
+        sorted = {};
+
+        std::vector<bool> alone(nodes.size());  // Cells kept out of runs
+        std::vector<int> unitOf(nodes.size());
+        std::vector<int> starts = groupRuns(nodes, alone, unitOf);
+
+        // Edges lead from a node to the nodes reading it
+        std::vector<std::vector<int>> edges(nodes.size());
+        auto node = [&](const cellContents &prec) {
+            // Only dirty formulas are nodes, the other cells need no lookup
+            if (!prec.state || !prec.dirty || prec.cyclic) return -1;
+            auto id = std::lower_bound(ids.begin(), ids.end(), prec.pos);
+            return id != ids.end() && *id == prec.pos ? int(id - ids.begin()) : -1;
+        };
+        for (size_t unit = 0; unit + 1 < starts.size(); unit++) {
+            int first = starts[unit], last = starts[unit + 1] - 1;
+            if (first == last) {
+                forEachPrecedent(*nodes[first], [&](const cellContents &prec) {
+                    if (int id = node(prec); id >= 0) edges[id].push_back(first);
+                });
+                continue;
+            }
+            // A run looks for the formulas it reads column by column. The operands of its top and
+            // bottom cell bound the rows each reference covers, they are equal for a fixed row.
+            std::vector<CPos> top, bottom;
+            const Bytecode &code = nodes[first]->formula->code;
+            code.forEachOperand(nodes[first]->pos, [&](const CPos &ref) { top.push_back(ref); }, [](const CRange &) {});
+            code.forEachOperand(nodes[last]->pos, [&](const CPos &ref) { bottom.push_back(ref); }, [](const CRange &) {});
+            for (size_t k = 0; k < top.size(); k++) {
+                if (top[k] == bottom[k]) {
+                    const cellContents *prec = array.find(top[k]);
+                    if (int id = prec ? node(*prec) : -1; id >= 0) {
+                        for (int reader = first; reader <= last; reader++) edges[id].push_back(reader);
+                    }
+                    continue;
+                }
+                array.forEachFormulaIn(top[k].getColumn(), top[k].getRow(), top[k].getColumn() + 1,
+                                       bottom[k].getRow() + 1, [&](const cellContents &prec) {
+                    if (int id = node(prec); id >= 0) edges[id].push_back(first + prec.pos.getRow() - top[k].getRow());
+                });
+            }
+        }
+        if (starts.size() <= nodes.size()) {
+            if (splitDependentRuns(starts, edges, unitOf, alone)) starts = groupRuns(nodes, alone, unitOf);
+            if (!acyclic(starts, edges, unitOf)) {
+                // A path leaving a run and coming back to it would make the units wait for each
+                // other, every cell is scheduled on its own then
+                std::fill(alone.begin(), alone.end(), true);
+                starts = groupRuns(nodes, alone, unitOf);
+            }
+        }
+        size_t units = starts.size() - 1;
+        std::vector<std::atomic<int>> waitingOn(units);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            for (int next: edges[i]) waitingOn[unitOf[next]]++;
+        }
+        std::vector<int> ready;
+        for (size_t unit = 0; unit < units; unit++) {
+            if (waitingOn[unit] == 0) ready.push_back(unit);
+        }
+
+        WorkStealingPool pool(threads);
+        pool.run(ready, units, [&](int unit, auto &push) {
+            try {
+                if (starts[unit + 1] - starts[unit] == 1) nodes[starts[unit]]->value(array);
+                else evaluateRun(&nodes[starts[unit]], starts[unit + 1] - starts[unit]);
+            }
+            catch (...) {
+                // Left dirty, getValue reports it as an empty value
+            }
+            for (int id = starts[unit]; id < starts[unit + 1]; id++) {
+                for (int next: edges[id]) {
+                    if (waitingOn[unitOf[next]].fetch_sub(1, std::memory_order_acq_rel) == 1) push(unitOf[next]);
+                }
+            }
+        });
+    }
+
+    // Copies a rectangle of cells from source to destination, only visiting the tiles
+    // the two rectangles overlap
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
+        if (w <= 0 || h <= 0) return;
+        std::unique_lock<std::shared_mutex> writing(lock);
+        applyQueued();
+        parsePending();
+        int xmove = dst.getColumn() - src.getColumn();
+        int ymove = dst.getRow() - src.getRow();
+
+        // Clones the source cells straight to their destination before anything is overwritten
+        std::vector<std::unique_ptr<cellContents>> copies;
+        array.forEachIn(src.getColumn(), src.getRow(), src.getColumn() + w, src.getRow() + h,
+                        [&](const cellContents &cell) {
+                            CPos pos(cell.pos.getColumn() + xmove, cell.pos.getRow() + ymove);
+                            copies.push_back(std::make_unique<cellContents>(cell, pos));
+                        });
+
+        // Clears the destination rectangle, copies then fill the non-empty part again
+        std::vector<CPos> changed;
+        array.forEachIn(dst.getColumn(), dst.getRow(), dst.getColumn() + w, dst.getRow() + h,
+                        [&](const cellContents &cell) {
+                            changed.push_back(cell.pos);
+                        });
+        for (const auto &pos: changed) {
+            putCell(pos, nullptr);
+        }
+        for (auto &cell: copies) {
+            CPos pos = cell->pos;
+            putCell(pos, std::move(cell));
+            changed.push_back(pos);
+        }
+        if (batching) batched.insert(batched.end(), changed.begin(), changed.end());
+        else update(changed);
+    }
+
+private:
+    mutable std::shared_mutex lock;  // Shared by readers, writers modifying the sheet hold it alone
+    // The members marked mutable are what a read may have to bring up to date first: it applies a
+    // batch or parses lazily loaded formulas through prepare, holding the write lock meanwhile.
+    // Everything a const method changes is one of them, so that is defined even on a const sheet.
+    mutable CellStore array;  // Contents of the non-empty cells
+    // Positions whose expressions read the key position, in shards per tile of the key
+    mutable SharedShards<uint64_t, std::map<CPos, std::set<CPos>>> dependents;
+    mutable SharedShards<int, RangeLinks> rangeDependents;  // Ranges read per column
+    std::shared_ptr<TemplatePool> templates = std::make_shared<TemplatePool>();  // Formulas of the sheet and its copies
+    mutable NodeArena scratch;  // Holds the nodes of a formula being parsed until it is interned
+    std::shared_ptr<NodeArena> sources = std::make_shared<NodeArena>();  // Texts of lazily loaded formulas
+    mutable bool pending = false;  // Lazily loaded formulas may be unparsed, the dependency links are incomplete
+    // Positions of the formulas parsed and flagged while pending. Kept by position, not by cell: a
+    // clone or an erase may free a cell and a new one reuse its address. Any put ends pending first.
+    mutable std::set<CPos> resolved;
+    mutable std::vector<CPos> changes;  // Positions put since the last saveChanges, compact or load, may repeat
+    bool batching = false;  // Between beginBatch and commit
+    mutable std::vector<std::pair<CPos, std::string>> queued;  // Contents set in the batch, not parsed yet
+    mutable bool queuedFailed = false;  // Queued contents of the batch did not parse
+    mutable std::vector<CPos> batched;  // Positions changed in the batch whose dependents are not updated yet
+
+    // Writes every cell as a record, the body of save and compact
+    bool write(std::ostream &os) const {
+        if (!os) {
+            return false;
+        }
+
+        std::string out, body;
+        array.forEach([&](const cellContents &cell) {
+            if (cell.broken()) return;
+            appendRecord(out, body, cell.pos, &cell);
+            if (out.size() >= FLUSH_SIZE) {
+                os.write(out.data(), out.size());
+                out.clear();
+            }
+        });
+        os.write(out.data(), out.size());
+        return bool(os);
+    }
+
+    // Takes on the contents of other, sharing them until either sheet writes
+    void share(const CSpreadsheet &other) {
+        array = other.array;
+        dependents = other.dependents;
+        rangeDependents = other.rangeDependents;
+        templates = other.templates;
+        sources = other.sources;
+        pending = other.pending;
+        resolved = other.resolved;
+        batched = other.batched;
+    }
+
+    // Takes the read lock for reading pos, or the whole sheet for nullptr. Until the sheet is ready
+    // for that read, it runs prepare as a writer first.
+    std::shared_lock<std::shared_mutex> readLock(const CPos *pos) const {
+        std::shared_lock<std::shared_mutex> reading(lock);
+        auto ready = [&]() {
+            if (!queued.empty()) return false;
+            if (pos == nullptr) return true;
+            const cellContents *cell = array.find(*pos);
+            return batched.empty() && (!pending || cell == nullptr || !cell->state || resolved.count(*pos));
+        };
+        while (!ready()) {
+            reading.unlock();
+            {
+                std::unique_lock<std::shared_mutex> writing(lock);
+                prepare(pos);
+            }
+            reading.lock();
+        }
+        return reading;
+    }
+
+    // Brings the sheet up to date for reading pos: applies the batch and parses the lazily loaded
+    // formulas pos depends on. Writes cells and links, readLock calls it under the write lock.
+    void prepare(const CPos *pos) const {
+        flushBatch();
+        if (pending && pos) resolve(*pos);
+    }
+
+    // Parses the contents queued by setCell in the batch and stores them, their dependents are
+    // updated with the rest of the batch
+    void applyQueued() const {
+        if (queued.empty()) return;
+        std::vector<std::pair<CPos, std::string>> contents = std::move(queued);
+        queued.clear();
+        if (!putContents(contents, std::thread::hardware_concurrency(), batched)) queuedFailed = true;
+    }
+
+    // Parses contents on the given number of threads and puts the cells, appending their positions
+    // to changed. Cells whose contents do not parse stay unchanged and make it return false.
+    bool putContents(const std::vector<std::pair<CPos, std::string>> &contents, unsigned threads,
+                     std::vector<CPos> &changed) const {
+        parsePending();
+        std::vector<std::unique_ptr<cellContents>> cells;
+        std::vector<Precedents> references;
+        buildCells(contents.size(), threads, cells, references, [&](size_t i, NodeArena &scratch) {
+            if (contents[i].second.empty()) throw std::invalid_argument("Invalid_Argument");
+            return std::make_unique<cellContents>(contents[i].second, contents[i].first, *templates, scratch);
+        });
+        bool ret = true;
+        for (size_t i = 0; i < cells.size(); i++) {
+            if (!cells[i]) {
+                ret = false;
+                continue;
+            }
+            putCell(contents[i].first, std::move(cells[i]), references[i]);
+            changed.push_back(contents[i].first);
+        }
+        return ret;
+    }
+
+    // Applies the batch collected so far: stores the queued contents and updates the dependents
+    void flushBatch() const {
+        applyQueued();
+        if (batched.empty()) return;
+        std::vector<CPos> changed = std::move(batched);
+        batched.clear();
+        refresh(changed);
+    }
+
+    // Updates after many positions changed, walking the whole sheet once when that is cheaper
+    void refresh(const std::vector<CPos> &changed) const {
+        if (changed.size() * 4 > array.size()) updateAll();
+        else update(changed);
+    }
+
+    // Empties the spreadsheet before a load
+    void reset() {
+        array.clear();
+        dependents.clear();
+        rangeDependents.clear();
+        templates = std::make_shared<TemplatePool>();
+        sources = std::make_shared<NodeArena>();
+        pending = false;
+        resolved.clear();
+        changes.clear();
+        batched.clear();
+        queued.clear();
+    }
+
+    // Moves the templates and strings the cells use to a new pool if the current one holds more
+    // than twice as many. The cells are owned first, copies sharing them keep the old pool.
+    void compactTemplates() {
+        std::unordered_set<const void *> used;
+        array.forEach([&](const cellContents &cell) {
+            if (cell.formula) used.insert(cell.formula);
+            else if (cell.text) used.insert(cell.text);
+        });
+        if (templates->size() <= used.size() * 2) return;
+        auto pool = std::make_shared<TemplatePool>();
+        std::unordered_map<const FormulaTemplate *, const FormulaTemplate *> moved;
+        array.forEachOwned([&](cellContents &cell) {
+            if (cell.formula) {
+                const FormulaTemplate *&formula = moved[cell.formula];
+                if (!formula) formula = pool->intern(*cell.formula);
+                cell.formula = formula;
+            } else if (cell.text) {
+                cell.text = pool->intern(std::get<std::string>(*cell.text));
+            }
+        });
+        templates = std::move(pool);
+    }
+
+    // Parses a formula at origin and returns its template
+    const FormulaTemplate *parseFormula(std::string_view text, const CPos &origin) const {
+        scratch.reset();
+        MyExprBuilder expression(scratch, origin);
+        FormulaParser(text, expression).parse();
+        return templates->intern(expression);
+    }
+
+    // Parses the text of a lazily loaded formula, false if it is not a valid formula
+    bool parseSource(cellContents &cell) const {
+        if (cell.source.empty()) return false;
+        try {
+            cell.formula = parseFormula(cell.source, cell.pos);
+        }
+        catch (...) {
+            return false;
+        }
+        cell.source = {};
+        return true;
+    }
+
+    // Parses the formulas pos reads, directly or through other cells, and flags the cycles among
+    // them, so a cell of a lazily loaded sheet can be evaluated without parsing the rest
+    void resolve(const CPos &pos) const {
+        std::vector<cellContents *> nodes, stack;
+        auto visit = [&](const CPos &at) {
+            const cellContents *found = array.find(at);
+            if (!found || !found->state || !resolved.insert(at).second) return;
+            cellContents *cell = array.own(at);
+            stack.push_back(cell);
+        };
+        visit(pos);
+        while (!stack.empty()) {
+            cellContents *cell = stack.back();
+            stack.pop_back();
+            if (!cell->formula && !parseSource(*cell)) {
+                cell->source = {};  // Broken, parsePending erases it
+                continue;
+            }
+            nodes.push_back(cell);
+            forEachPrecedent(*cell, [&](const cellContents &prec) { visit(prec.pos); });
+        }
+        flagCycles(nodes);
+    }
+
+    // Parses what is left of a lazy load and links every formula, after which the sheet is
+    // the same as if it had been loaded eagerly
+    void parsePending() const {
+        if (!pending) return;
+        pending = false;
+        resolved.clear();
+        std::vector<CPos> failed;
+        std::vector<cellContents *> nodes;
+        array.forEachOwned([&](cellContents &cell) {
+            if (!cell.state) return;
+            if (!cell.formula && !parseSource(cell)) failed.push_back(cell.pos);
+            else nodes.push_back(&cell);
+        });
+        for (const auto &pos: failed) array.put(pos, nullptr);
+        for (cellContents *cell: nodes) addLinks(cell->pos, cell->references());
+        flagCycles(nodes);
+    }
+
+    // Parses (POS;LEN;TEXT) records and the (POS;;) erase records of journals into the array. Reads
+    // the stream in large blocks and scans them in place, each text is copied out of the block in
+    // one piece. Batches of records are turned into cells on the given number of threads, then put
+    // into the array in file order.
+    bool readRecords(std::istream &is, bool lazy, unsigned threads) {
+        std::vector<char> buffer(1 << 20);
+        size_t begin = 0, end = 0;
+        // Makes at least n unread bytes available, false if the stream ends first
+        auto fill = [&](size_t n) {
+            if (end - begin >= n) return true;
+            if (!is) return false;
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            if (buffer.size() < n) buffer.resize(std::max(n, buffer.size() * 2));
+            while (end < n) {
+                std::streamsize got = is.rdbuf()->sgetn(buffer.data() + end, buffer.size() - end);
+                if (got <= 0) return false;
+                end += got;
+            }
+            return true;
+        };
+        // Reads up to the next ';' and skips it
+        auto field = [&](std::string_view &ret) {
+            size_t scanned = 0;
+            while (true) {
+                const char *start = buffer.data() + begin;
+                auto stop = static_cast<const char *>(std::memchr(start + scanned, ';', end - begin - scanned));
+                if (stop) {
+                    ret = std::string_view(start, stop - start);
+                    begin += ret.size() + 1;
+                    return true;
+                }
+                scanned = end - begin;
+                if (!fill(scanned + 1)) return false;
+            }
+        };
+
+        struct Record {
+            CPos pos;
+            std::string_view kept;  // Text of a lazily loaded formula, already in sources
+            size_t at, length;  // Text of any other record in texts
+            bool erase;  // The (POS;;) record of a journal
+        };
+        constexpr size_t BATCH = 1 << 16;
+        std::vector<Record> batch;
+        std::string texts;
+        // Builds the cells of the batch and puts them, false if a record does not parse.
+        // Records after the first bad one are dropped, as if they had been read one by one.
+        auto flush = [&]() {
+            std::vector<std::unique_ptr<cellContents>> cells;
+            std::vector<Precedents> references;
+            buildCells(batch.size(), threads, cells, references, [&](size_t i, NodeArena &scratch) {
+                const Record &record = batch[i];
+                if (record.erase) return std::unique_ptr<cellContents>();
+                if (!record.kept.empty()) {
+                    FormulaCheck::check(record.kept, record.pos);
+                    return std::make_unique<cellContents>(record.kept, record.pos);
+                }
+                return std::make_unique<cellContents>(texts.substr(record.at, record.length), record.pos, *templates,
+                                                      scratch);
+            });
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (!cells[i] && !batch[i].erase) return false;
+                putCell(batch[i].pos, std::move(cells[i]), references[i]);
+            }
+            batch.clear();
+            texts.clear();
+            return true;
+        };
+
+        while (true) {
+            if (batch.size() == BATCH && !flush()) return false;
+            while (fill(1) && buffer[begin] == ' ') begin++;
+            if (!fill(1)) return flush();
+            if (buffer[begin++] != '(') return flush() && false;
+            std::string_view field1, field2;
+            if (!field(field1)) return flush() && false;
+            std::optional<CPos> pos;
+            try {
+                pos.emplace(field1);
+            }
+            catch (...) {
+                return flush() && false;
+            }
+            if (!field(field2)) return flush() && false;
+            if (field2.empty() && fill(1) && buffer[begin] == ')') {
+                begin++;
+                batch.push_back({*pos, {}, 0, 0, true});
+                continue;
+            }
+            size_t length = 0;
+            auto parsed = std::from_chars(field2.data(), field2.data() + field2.size(), length);
+            if (field2.empty() || parsed.ec != std::errc() || parsed.ptr != field2.data() + field2.size() ||
+                !fill(length + 1) || buffer[begin + length] != ')') {
+                return flush() && false;
+            }
+            std::string_view record(buffer.data() + begin, length);
+            begin += length + 1;
+            if (lazy && record.size() > 1 && record[0] == '=') {
+                batch.push_back({*pos, sources->copy(record), 0, 0, false});
+            } else {
+                batch.push_back({*pos, {}, texts.size(), length, false});
+                texts += record;
+            }
+        }
+    }
+
+    // Builds n cells on the given number of threads, make(i, scratch) returns cell i and the
+    // references of each cell are collected alongside. A cell whose make throws is left null.
+    template<typename Make>
+    void buildCells(size_t n, unsigned threads, std::vector<std::unique_ptr<cellContents>> &cells,
+                    std::vector<Precedents> &references, Make make) const {
+        constexpr size_t CHUNK = 1 << 10;
+        cells.resize(n);
+        references.resize(n);
+        size_t chunks = (n + CHUNK - 1) / CHUNK;
+        std::vector<int> ids(chunks);
+        std::iota(ids.begin(), ids.end(), 0);
+        WorkStealingPool pool(std::min<size_t>(threads, chunks));
+        pool.run(ids, chunks, [&](int chunk, auto &) {
+            thread_local NodeArena scratch;
+            for (size_t i = chunk * CHUNK; i < std::min(n, (chunk + 1) * CHUNK); i++) {
+                try {
+                    cells[i] = make(i, scratch);
+                    if (cells[i]) references[i] = cells[i]->references();
+                }
+                catch (...) {
+                    // Left null
+                }
+            }
+        });
     }
-}
 
-class CSpreadsheet {
-public:
-    static unsigned capabilities() {
-        return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS | SPREADSHEET_FILE_IO | SPREADSHEET_SPEED |
-               SPREADSHEET_PARSER;
+    template<typename T>
+    static void appendRaw(std::string &out, const T &val) {
+        out.append(reinterpret_cast<const char *>(&val), sizeof(val));
     }
 
-    CSpreadsheet() = default;
+    template<typename T>
+    static T readRaw(const char *at) {
+        T ret;
+        std::memcpy(&ret, at, sizeof(ret));
+        return ret;
+    }
 
-    // Assignment operator
-    CSpreadsheet &operator=(const CSpreadsheet &other) {
-        array.clear();
-        for (const auto &cell: other.array) {
-            array[cell.first] = std::make_shared<cellContents>(*cell.second, array, 0, 0);
+    // Puts the cells of a snapshot inside region into the array, false if the snapshot is malformed
+    bool readSnapshot(const char *data, size_t size, const CRange &region) {
+        if (size < sizeof(SnapshotHeader)) return false;
+        auto header = readRaw<SnapshotHeader>(data);
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.size != size) return false;
+        // The offsets come from the file, they are bounded by size before anything is added to them
+        if (header.tiles > size / sizeof(SnapshotTile) || header.stringsAt > size || header.templatesAt > size ||
+            sizeof(header) + header.tiles * sizeof(SnapshotTile) > header.stringsAt ||
+            header.stringsAt > header.templatesAt ||
+            header.strings > (header.templatesAt - header.stringsAt) / sizeof(uint64_t) ||
+            header.templates > (size - header.templatesAt) / sizeof(uint64_t)) {
+            return false;
+        }
+        // Entry i of a table spans from the end of entry i - 1 to its own end
+        auto entry = [&](uint64_t at, uint64_t count, uint64_t limit, uint64_t i) {
+            uint64_t base = at + count * sizeof(uint64_t);
+            uint64_t begin = i ? readRaw<uint64_t>(data + at + (i - 1) * sizeof(uint64_t)) : 0;
+            uint64_t end = readRaw<uint64_t>(data + at + i * sizeof(uint64_t));
+            if (begin > end || end > limit - base) throw std::invalid_argument("Invalid_Argument");
+            return std::string_view(data + base + begin, end - begin);
+        };
+        std::vector<const FormulaTemplate *> formulas(header.templates);
+        std::vector<const CValue *> texts(header.strings);  // Interned on first use, like the templates
+        auto formula = [&](uint64_t i) {
+            if (i >= formulas.size()) throw std::invalid_argument("Invalid_Argument");
+            if (!formulas[i]) {
+                std::string_view text = entry(header.templatesAt, header.templates, size, i);
+                if (text.size() < 2 * sizeof(int32_t)) throw std::invalid_argument("Invalid_Argument");
+                CPos origin(readRaw<int32_t>(text.data()), readRaw<int32_t>(text.data() + sizeof(int32_t)));
+                formulas[i] = parseFormula(text.substr(2 * sizeof(int32_t)), origin);
+            }
+            return formulas[i];
+        };
+
+        for (uint64_t t = 0; t < header.tiles; t++) {
+            auto tile = readRaw<SnapshotTile>(data + sizeof(header) + t * sizeof(SnapshotTile));
+            // Tile coordinates come from the file, a shifted one must still be a position
+            constexpr int32_t TILE_MIN = std::numeric_limits<int>::min() >> CellStore::TILE_BITS;
+            constexpr int32_t TILE_MAX = std::numeric_limits<int>::max() >> CellStore::TILE_BITS;
+            if (tile.col < TILE_MIN || tile.col > TILE_MAX || tile.row < TILE_MIN || tile.row > TILE_MAX) return false;
+            int64_t col0 = int64_t(tile.col) << CellStore::TILE_BITS, row0 = int64_t(tile.row) << CellStore::TILE_BITS;
+            if (col0 > region.to.getColumn() || col0 + CellStore::TILE_SIZE <= region.from.getColumn() ||
+                row0 > region.to.getRow() || row0 + CellStore::TILE_SIZE <= region.from.getRow()) {
+                continue;
+            }
+            if (tile.at < header.templatesAt || tile.at > size - sizeof(uint64_t)) return false;
+            auto count = readRaw<uint64_t>(data + tile.at);
+            if (count > CellStore::TILE_SIZE * CellStore::TILE_SIZE ||
+                tile.at + sizeof(uint64_t) + count * (sizeof(uint64_t) + sizeof(uint16_t) + 1) > size) {
+                return false;
+            }
+            const char *payloads = data + tile.at + sizeof(uint64_t);
+            const char *slots = payloads + count * sizeof(uint64_t);
+            const char *kinds = slots + count * sizeof(uint16_t);
+            for (uint64_t i = 0; i < count; i++) {
+                auto slot = readRaw<uint16_t>(slots + i * sizeof(uint16_t));
+                if (slot >= CellStore::TILE_SIZE * CellStore::TILE_SIZE) return false;
+                CPos pos(col0 + slot / CellStore::TILE_SIZE, row0 + slot % CellStore::TILE_SIZE);
+                if (!region.contains(pos)) continue;
+                auto payload = readRaw<uint64_t>(payloads + i * sizeof(uint64_t));
+                std::unique_ptr<cellContents> cell;
+                switch (SnapshotKind(kinds[i])) {
+                    case SnapshotKind::Number:
+                        cell = std::make_unique<cellContents>(CValue(readRaw<double>(payloads + i * sizeof(uint64_t))), pos);
+                        break;
+                    case SnapshotKind::String:
+                        if (payload >= header.strings) return false;
+                        if (!texts[payload]) {
+                            texts[payload] = templates->intern(
+                                    entry(header.stringsAt, header.strings, header.templatesAt, payload));
+                        }
+                        cell = std::make_unique<cellContents>(texts[payload], pos);
+                        break;
+                    case SnapshotKind::Formula:
+                        cell = std::make_unique<cellContents>(formula(payload), pos);
+                        break;
+                    case SnapshotKind::Empty:
+                        cell = std::make_unique<cellContents>(CValue(), pos);
+                        break;
+                    default:
+                        return false;
+                }
+                putCell(pos, std::move(cell));
+            }
         }
-        return *this;
+        return true;
     }
 
-    CSpreadsheet(const CSpreadsheet &other) {
-        for (auto cell: other.array) {
-            array[cell.first] = std::make_shared<cellContents>(*cell.second, array, 0, 0);
+    static constexpr size_t FLUSH_SIZE = 1 << 20;  // Bytes collected before they are written to a stream
+
+    // Appends the (POS;LEN;TEXT) record of cell, or the erase record (POS;;) for nullptr.
+    // body is scratch space, reused between calls so records do not allocate.
+    static void appendRecord(std::string &out, std::string &body, const CPos &pos, const cellContents *cell) {
+        out += '(';
+        pos.appendColumn(out);
+        appendNumber(out, pos.getRow());
+        out += ';';
+        if (cell == nullptr) {
+            out += ";) ";
+            return;
         }
+        body.clear();
+        if (cell->state) {
+            if (cell->formula) {
+                body += '=';
+                cell->formula->root->write(body, cell->pos);
+            } else {
+                body += cell->source;
+            }
+        } else if (auto number = std::get_if<double>(&cell->val)) {
+            appendNumber(body, *number);
+        } else if (cell->text) {
+            body += std::get<std::string>(*cell->text);
+        }
+        appendNumber(out, body.size());
+        out += ';';
+        out += body;
+        out += ") ";
     }
 
-    CSpreadsheet(CSpreadsheet &&other) noexcept: array(std::move(other.array)) {
-        other.array.clear();
+    // Puts a cell at pos (erases it for nullptr) and relinks the reverse edges of its references
+    void putCell(const CPos &pos, std::unique_ptr<cellContents> cell) {
+        Precedents precs;
+        if (cell) precs = cell->references();
+        putCell(pos, std::move(cell), precs);
     }
 
-    // Loads the spreadsheet from a stream
-    bool load(std::istream &is) {
-        bool bracket = false;
-        int state = 0;
-        array.clear();
-
-        std::string position = "";
-        std::string length = "";
-        std::string expr = "";
-
-        while (is.peek() != std::istream::traits_type::eof()) {
-            char cur;
-            is.get(cur);
-            if (cur == '(' && state == 0) {
-                if (bracket) return false;
-                bracket = true;
-                state = 1;
-            } else if (cur == ')' && state == 3) {
-                if (!bracket) return false;
-                bracket = false;
-                array[CPos(position)] = std::make_shared<cellContents>(expr, array);
-                state = 0;
-                length = "";
-                position = "";
-                expr = "";
-
-            } else if (cur == ';') {
-                if (state > 3) return false;
-                state++;
-                if (state == 3) {
-                    for (int i = 0; i < std::stoi(length); ++i) {
-                        is.get(cur);
-                        expr += cur;
-                    }
+    // Same as above with the references of cell already collected
+    void putCell(const CPos &pos, std::unique_ptr<cellContents> cell, const Precedents &references) const {
+        changes.push_back(pos);
+        if (const cellContents *old = array.find(pos)) {
+            // Kept until update flags the cell again, so it can tell whether the flag changed
+            if (cell) cell->cyclic = old->cyclic;
+            Precedents precs = old->references();
+            for (const auto &ref: precs.cells) {
+                uint64_t key = CellStore::tileKey(ref);
+                const auto *shard = dependents.find(key);
+                if (shard == nullptr || shard->find(ref) == shard->end()) continue;  // Repeated reference, already unlinked
+                auto &links = dependents.modify(key);
+                auto deps = links.find(ref);
+                deps->second.erase(pos);
+                if (deps->second.empty()) links.erase(deps);
+                if (links.empty()) dependents.erase(key);
+            }
+            for (const auto &range: precs.ranges) {
+                for (int col = range.from.getColumn(); col <= range.to.getColumn(); col++) {
+                    if (rangeDependents.find(col) == nullptr) continue;
+                    auto &links = rangeDependents.modify(col);
+                    links.remove(range, pos);
+                    if (links.empty()) rangeDependents.erase(col);
                 }
-
-            } else if (cur == ' ' && state == 0) {
-                if (bracket) return false;
-            } else {
-                if (state == 1) {
-                    position += cur;
-                } else if (state == 2) {
-                    length += cur;
-                } else return false;
             }
         }
-        return true;
+        if (cell) addLinks(pos, references);
+        array.put(pos, std::move(cell));
     }
 
-    // Saves the spreadsheet to a stream
-    bool save(std::ostream &os) const {
-        if (!os) {
-            return false;
+    // Adds the reverse edges from the references of the expression at pos
+    void addLinks(const CPos &pos, const Precedents &precs) const {
+        for (const auto &ref: precs.cells) {
+            dependents.modify(CellStore::tileKey(ref))[ref].insert(pos);
+        }
+        for (const auto &range: precs.ranges) {
+            for (int col = range.from.getColumn(); col <= range.to.getColumn(); col++) {
+                rangeDependents.modify(col).add(range, pos);
+            }
         }
+    }
 
-        for (const auto &cell: array) {
-            os << "(" << cell.first.getReverseColumn() << cell.first.getRow() << ';';
-            if (cell.second->state) {
-                std::string temp = cell.second->expression.getRoot()->toString(true);
-                int size = temp.size();
-                os << size << ';';
-                os << temp;
-            } else {
-                if (std::holds_alternative<double>(cell.second->val)) {
-                    double temp = std::get<double>(cell.second->val);
-                    std::string size = std::to_string(temp);
-                    int sizer = size.size();
-                    os << sizer << ';';
-                    os << size;
-                } else if (std::holds_alternative<std::string>(cell.second->val)) {
-                    std::string temp = std::get<std::string>(cell.second->val);
-                    int size = temp.size();
-                    os << size << ';';
-                    os << temp;
-                } else {
-                    os << '0' << ';';
-                }
+    // Calls fn with every formula cell the expression of cell reads, directly or through a range
+    template<typename Fn>
+    void forEachPrecedent(const cellContents &cell, Fn fn) const {
+        // Read from the program, it names each operand once and needs no Precedents lists
+        if (cell.formula == nullptr) return;  // Nothing is known about an unparsed formula
+        cell.formula->code.forEachOperand(cell.pos, [&](const CPos &ref) {
+            if (const cellContents *prec = array.find(ref)) fn(*prec);
+        }, [&](const CRange &range) {
+            // Constants never change on their own, only the formulas are visited
+            array.forEachFormulaIn(range.from.getColumn(), range.from.getRow(), range.to.getColumn() + 1,
+                                   range.to.getRow() + 1, fn);
+        });
+    }
+
+    // Marks the changed positions and their transitive dependents dirty and recomputes their cycle
+    // flags. Only cells reachable from a change can gain or lose a cycle. The graph it walks has a
+    // node per range between the cells inside the range and the cells reading it, so a range read by
+    // many cells costs one edge per cell. A component that holds no changed position and reads no
+    // node whose flag changed keeps its flags without looking at its precedents.
+    void update(const std::vector<CPos> &changed) const {
+        struct Node {
+            CPos pos;  // Position of a cell node
+            const std::set<CPos> *range;  // Readers of a range node, null for a cell node
+            bool exists = false;  // A cell node with a cell, the rest are erased positions
+            bool recheck = false;  // Its cell changed, or a node before it changed its flag
+        };
+        std::vector<Node> nodes;
+        std::vector<std::vector<int>> edges;  // From a node to the nodes reading it
+        std::unordered_map<CPos, int, PosHash> cellIds;
+        std::unordered_map<CRange, int, PosHash> rangeIds;
+        auto cellNode = [&](const CPos &pos) {
+            auto id = cellIds.try_emplace(pos, nodes.size());
+            if (id.second) {
+                nodes.push_back({pos, nullptr});
+                edges.emplace_back();
             }
-            os << ") ";
+            return id.first->second;
+        };
+        for (const auto &pos: changed) {
+            nodes[cellNode(pos)].recheck = true;
         }
-        if (!os) {
-            return false;
+        // Breadth first, each node lists its readers once
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (const std::set<CPos> *readers = nodes[i].range) {
+                for (const auto &dep: *readers) {
+                    int id = cellNode(dep);
+                    edges[i].push_back(id);
+                }
+                continue;
+            }
+            CPos pos = nodes[i].pos;
+            if (array.find(pos)) {
+                nodes[i].exists = true;
+                array.invalidate(pos);
+            }
+            if (const auto *shard = dependents.find(CellStore::tileKey(pos))) {
+                auto deps = shard->find(pos);
+                if (deps != shard->end()) {
+                    for (const auto &dep: deps->second) {
+                        int id = cellNode(dep);
+                        edges[i].push_back(id);
+                    }
+                }
+            }
+            if (const auto *links = rangeDependents.find(pos.getColumn())) {
+                links->forEachRangeContaining(pos, [&](const CRange &range, const std::set<CPos> &readers) {
+                    // Every column of the range lists the same readers, any of them will do
+                    auto id = rangeIds.try_emplace(range, nodes.size());
+                    if (id.second) {
+                        nodes.push_back({range.from, &readers});
+                        edges.emplace_back();
+                    }
+                    edges[i].push_back(id.first->second);
+                });
+            }
         }
-        return true;
-    }
 
-    // Sets the contents of a cell
-    bool setCell(CPos pos, std::string contents) {
-        if (contents.empty()) return false;
-        try {
-            array[pos] = std::make_shared<cellContents>(contents, array);
+        // Tarjan emits components dependents first, so walk them backwards
+        auto components = stronglyConnected(edges);
+        std::vector<int> componentOf(nodes.size());
+        for (size_t c = 0; c < components.size(); c++) {
+            for (int node: components[c]) componentOf[node] = c;
         }
-        catch (...) {
-            return false;
+        for (auto component = components.rbegin(); component != components.rend(); ++component) {
+            bool recheck = false;
+            for (int node: *component) {
+                if (nodes[node].recheck) recheck = true;
+            }
+            if (!recheck) continue;
+            bool cyclic = component->size() > 1, flipped = false;
+            for (int node: *component) {
+                for (int next: edges[node]) {
+                    if (next == node) cyclic = true;
+                }
+            }
+            for (int node: *component) {
+                if (cyclic || nodes[node].range || !nodes[node].exists) continue;
+                forEachPrecedent(*array.find(nodes[node].pos), [&](const cellContents &prec) {
+                    if (prec.cyclic) cyclic = true;
+                });
+            }
+            for (int node: *component) {
+                if (nodes[node].range) {
+                    flipped = true;  // Passes on the change that made it recheck
+                } else if (!nodes[node].exists) {
+                    flipped = true;  // Its old flag is gone, the readers look again
+                } else if (array.find(nodes[node].pos)->cyclic != cyclic) {
+                    array.own(nodes[node].pos)->cyclic = cyclic;
+                    flipped = true;
+                }
+            }
+            if (!flipped) continue;
+            int self = componentOf[component->front()];
+            for (int node: *component) {
+                for (int next: edges[node]) {
+                    if (componentOf[next] != self) nodes[next].recheck = true;
+                }
+            }
         }
-        return true;
     }
 
-    // Gets the value of a cell
-    CValue getValue(CPos pos) {
-        auto somepos = array.find(pos);
-        if (somepos == array.end()) {
-            return CValue();
+    // Marks every cell dirty and flags the cycles of the whole sheet, the same as update with every
+    // position changed. Walks precedents instead of dependents, so a range over many constants is one step
+    void updateAll() const {
+        std::vector<cellContents *> nodes;
+        array.forEachOwned([&](cellContents &cell) {
+            cell.dirty = true;
+            cell.cyclic = false;
+            if (cell.state) nodes.push_back(&cell);
+        });
+        array.invalidateLookups();
+        flagCycles(nodes);
+    }
+
+    // Flags the formula cells of nodes that lie on a cycle or read a cell that does. Precedents
+    // outside nodes must be flagged already.
+    void flagCycles(const std::vector<cellContents *> &nodes) const {
+        std::unordered_map<const cellContents *, int> ids;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            ids.emplace(nodes[i], i);
+            nodes[i]->cyclic = false;
         }
-        counter = 0;
-        try {
-            return somepos->second->getResult();
+        std::vector<std::vector<int>> edges(nodes.size());
+        std::vector<char> readsCyclic(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            forEachPrecedent(*nodes[i], [&](const cellContents &prec) {
+                auto id = ids.find(&prec);
+                if (id != ids.end()) edges[i].push_back(id->second);
+                else if (prec.cyclic) readsCyclic[i] = true;
+            });
         }
-        catch (...) {
-            return CValue();
+
+        // Edges point to precedents, so Tarjan emits the precedents of a component before it
+        for (const auto &component: stronglyConnected(edges)) {
+            bool cyclic = component.size() > 1;
+            for (int node: component) {
+                if (readsCyclic[node]) cyclic = true;
+                for (int next: edges[node]) {
+                    if (next == node || nodes[next]->cyclic) cyclic = true;
+                }
+            }
+            for (int node: component) {
+                nodes[node]->cyclic = cyclic;
+            }
         }
     }
 
-    // Copies a rectangle of cells from source to destination
-    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
-        if (w == 0 || h == 0) return;
-        int xstart = src.getColumn();
-        int xend = src.getColumn() + w;
-        int ystart = src.getRow();
-        int yend = src.getRow() + h;
-        int xmove = dst.getColumn() - src.getColumn();
-        int ymove = dst.getRow() - src.getRow();
-
-        std::map<CPos, std::shared_ptr<cellContents>> tempArray;
+    // Iterative Tarjan, so long reference chains cannot overflow the call stack
+    static std::vector<std::vector<int>> stronglyConnected(const std::vector<std::vector<int>> &edges) {
+        int n = edges.size();
+        int next = 0;
+        std::vector<int> index(n, -1), low(n, 0);
+        std::vector<bool> onStack(n, false);
+        std::vector<int> stack;
+        std::vector<std::pair<int, size_t>> calls;
+        std::vector<std::vector<int>> components;
+
+        for (int root = 0; root < n; root++) {
+            if (index[root] != -1) continue;
+            index[root] = low[root] = next++;
+            stack.push_back(root);
+            onStack[root] = true;
+            calls.emplace_back(root, 0);
+            while (!calls.empty()) {
+                int node = calls.back().first;
+                if (calls.back().second < edges[node].size()) {
+                    int succ = edges[node][calls.back().second++];
+                    if (index[succ] == -1) {
+                        index[succ] = low[succ] = next++;
+                        stack.push_back(succ);
+                        onStack[succ] = true;
+                        calls.emplace_back(succ, 0);
+                    } else if (onStack[succ]) {
+                        low[node] = std::min(low[node], index[succ]);
+                    }
+                    continue;
+                }
+                if (low[node] == index[node]) {
+                    components.emplace_back();
+                    int member;
+                    do {
+                        member = stack.back();
+                        stack.pop_back();
+                        onStack[member] = false;
+                        components.back().push_back(member);
+                    } while (member != node);
+                }
+                calls.pop_back();
+                if (!calls.empty()) {
+                    low[calls.back().first] = std::min(low[calls.back().first], low[node]);
+                }
+            }
+        }
+        return components;
+    }
 
-        // Copies cells from source rectangle
-        for (const auto &cell: array) {
-            if (!(cell.first.getColumn() >= xstart && cell.first.getColumn() < xend
-                  && cell.first.getRow() >= ystart && cell.first.getRow() < yend)) {
-                continue;
+    // Groups the dirty cells recalculate schedules, sorted by position, into units: runs of cells below
+    // each other with the same numeric formula, which evaluateRun computes as one column, and single
+    // cells, which all cells marked alone are. Fills unitOf and returns where each unit starts in
+    // nodes, followed by nodes.size().
+    static std::vector<int> groupRuns(const std::vector<const cellContents *> &nodes, const std::vector<bool> &alone,
+                                      std::vector<int> &unitOf) {
+        // Shorter runs are not worth it, longer ones are split so that threads can share them
+        constexpr size_t MIN_RUN = 16, MAX_RUN = 4096;
+        auto runs = [&](const cellContents &above, const cellContents &cell) {
+            return cell.formula == above.formula && above.formula && above.formula->code.numeric() &&
+                   cell.pos.getColumn() == above.pos.getColumn() && cell.pos.getRow() == above.pos.getRow() + 1;
+        };
+        std::vector<int> starts;
+        for (size_t i = 0; i < nodes.size();) {
+            size_t end = i + 1;
+            while (end < nodes.size() && end - i < MAX_RUN && !alone[i] && !alone[end] &&
+                   runs(*nodes[end - 1], *nodes[end])) {
+                end++;
             }
-            tempArray[CPos(cell.first.getColumn() + xmove, cell.first.getRow() + ymove)] =
-                    std::make_shared<cellContents>(*cell.second, array, xmove, ymove);
+            if (end - i < MIN_RUN) end = i + 1;
+            for (size_t id = i; id < end; id++) unitOf[id] = starts.size();
+            starts.push_back(i);
+            i = end;
         }
+        starts.push_back(nodes.size());
+        return starts;
+    }
 
-        xstart = dst.getColumn();
-        xend = dst.getColumn() + w;
-        ystart = dst.getRow();
-        yend = dst.getRow() + h;
+    // Marks the cells of every run in which a cell reads another one, like a running total, alone.
+    // Returns true if there was such a run.
+    static bool splitDependentRuns(const std::vector<int> &starts, const std::vector<std::vector<int>> &edges,
+                                   const std::vector<int> &unitOf, std::vector<bool> &alone) {
+        bool split = false;
+        for (size_t i = 0; i < edges.size(); i++) {
+            for (int next: edges[i]) {
+                if (unitOf[next] != unitOf[i]) continue;
+                for (int id = starts[unitOf[i]]; id < starts[unitOf[i] + 1]; id++) alone[id] = true;
+                split = true;
+            }
+        }
+        return split;
+    }
 
-        // Deletes destination rectangle cells
-        for (auto cell = array.begin(); cell != array.end();) {
-            if (cell->first.getColumn() >= xstart && cell->first.getColumn() < xend &&
-                cell->first.getRow() >= ystart && cell->first.getRow() < yend) {
-                if (tempArray.find(cell->first) == tempArray.end()) {
-                    cell = array.erase(cell);
-                } else {
-                    ++cell;
+    // True if the units can be ordered so that every unit comes after the units it reads
+    static bool acyclic(const std::vector<int> &starts, const std::vector<std::vector<int>> &edges,
+                        const std::vector<int> &unitOf) {
+        std::vector<int> waiting(starts.size() - 1);
+        for (const auto &readers: edges) {
+            for (int next: readers) waiting[unitOf[next]]++;
+        }
+        std::vector<int> order;
+        for (size_t unit = 0; unit < waiting.size(); unit++) {
+            if (waiting[unit] == 0) order.push_back(unit);
+        }
+        for (size_t done = 0; done < order.size(); done++) {
+            for (int id = starts[order[done]]; id < starts[order[done] + 1]; id++) {
+                for (int next: edges[id]) {
+                    if (--waiting[unitOf[next]] == 0) order.push_back(unitOf[next]);
                 }
-            } else {
-                ++cell;
             }
         }
+        return order.size() == waiting.size();
+    }
 
-        // Inserts copied cells into the array
-        for (const auto &cell: tempArray) {
-            array[cell.first] = std::make_shared<cellContents>(*cell.second, array, 0, 0);
+    // Evaluates a run of cells below each other with the same numeric formula as one column. Rows
+    // that read a string are evaluated one by one.
+    void evaluateRun(const cellContents *const *cells, int count) const {
+        std::vector<double> results(count);
+        std::vector<unsigned char> flags(count);
+        cells[0]->formula->code.runColumn(EvalContext{array, cells[0]->pos}, count, results.data(), flags.data());
+        for (int i = 0; i < count; i++) {
+            if (flags[i] & Bytecode::ROW_MIXED) cells[i]->value(array);
+            else if (flags[i]) cells[i]->store(CValue());
+            else cells[i]->store(results[i]);
         }
     }
 
-private:
-    std::map<CPos, std::shared_ptr<cellContents>> array;  // Map of cell positions to contents
+    // Brings the dirty precedents of pos up to date bottom-up, so evaluating
+    // a long chain never recurses deeper than one reference
+    void evaluate(const CPos &pos) const {
+        std::vector<std::pair<CPos, bool>> stack;
+        stack.emplace_back(pos, false);
+        while (!stack.empty()) {
+            const cellContents *cell = array.find(stack.back().first);
+            if (cell == nullptr || !cell->state || !cell->dirty || cell->cyclic) {
+                stack.pop_back();
+                continue;
+            }
+            if (stack.back().second) {
+                cell->value(array);
+                stack.pop_back();
+                continue;
+            }
+            stack.back().second = true;
+            forEachPrecedent(*cell, [&](const cellContents &prec) {
+                if (prec.state && prec.dirty) stack.emplace_back(prec.pos, false);
+            });
+        }
+    }
 };
 
 bool valueMatch(const CValue &r, const CValue &s) {
@@ -1271,7 +5557,428 @@ bool valueMatch(const CValue &r, const CValue &s) {
     return fabs(std::get<double>(r) - std::get<double>(s)) <= 1e8 * DBL_EPSILON * fabs(std::get<double>(r));
 }
 
-int main() {
+// Times fn and prints how many units per second it processed
+template<typename Fn>
+double benchmark(const std::string &name, double units, const std::string &unit, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << took.count() * 1000 << " ms, " << units / took.count() / 1e6 << " M" << unit
+              << "/s" << std::endl;
+    return took.count();
+}
+
+// Evaluates the same formulas through the expression tree and through their bytecode,
+// either reading their operands from cells or with the operands written as constants
+void benchFormulaEval(bool references) {
+    CellStore array;
+    TemplatePool templates;
+    NodeArena scratch;
+    const int rows = 10000, rounds = 100;
+    std::vector<std::shared_ptr<cellContents>> formulas;
+    for (int row = 0; row < rows; row++) {
+        array.put(CPos(1, row), std::make_unique<cellContents>(std::to_string(row % 97 + 1), CPos(1, row), templates,
+                                                               scratch));
+        array.put(CPos(2, row), std::make_unique<cellContents>(std::to_string(row % 13 + 2), CPos(2, row), templates,
+                                                               scratch));
+        std::string a = "A" + std::to_string(row), b = "B" + std::to_string(row);
+        if (!references) {
+            a = std::to_string(row % 97 + 1);
+            b = std::to_string(row % 13 + 2);
+        }
+        formulas.push_back(std::make_shared<cellContents>(
+                "=(" + a + "+" + b + ")*(" + a + "-" + b + ")/2+" + a + "^2-" + b + "*3+(" + a + ">" + b + ")",
+                CPos(3, row), templates, scratch));
+    }
+    double treeSum = 0, codeSum = 0;
+    std::cout << (references ? "formulas reading cells" : "constant formulas") << std::endl;
+    double tree = benchmark("tree walker", double(rows) * rounds, "formulas", [&]() {
+        for (int round = 0; round < rounds; round++) {
+            for (const auto &cell: formulas) treeSum += std::get<double>(cell->formula->root->eval(EvalContext{array, cell->pos}));
+        }
+    });
+    double code = benchmark("bytecode", double(rows) * rounds, "formulas", [&]() {
+        for (int round = 0; round < rounds; round++) {
+            for (const auto &cell: formulas) codeSum += std::get<double>(cell->formula->code.run(EvalContext{array, cell->pos}));
+        }
+    });
+    if (treeSum != codeSum) std::cout << "bytecode result mismatch" << std::endl;
+    std::cout << "bytecode speedup: " << tree / code << "x" << std::endl;
+}
+
+// Fills one formula down a long column by doubling the copied block,
+// the copies only attach the shared template
+void benchFillDown() {
+    CSpreadsheet sheet;
+    const int rows = 200000;
+    for (int row = 1; row <= rows; row++) {
+        sheet.setCell(CPos(1, row), std::to_string(row));
+    }
+    sheet.setCell(CPos(2, 1), "=(A1*3+$A$1)/2-A1^2");
+    benchmark("fill down copyRect", rows, "cells", [&]() {
+        for (int filled = 1; filled < rows; filled *= 2) {
+            sheet.copyRect(CPos(2, filled + 1), CPos(2, 1), 1, std::min(filled, rows - filled));
+        }
+    });
+}
+
+// Copies a small block around a large sheet, each copy only touches the tiles of its rectangles
+void benchSmallCopies() {
+    CSpreadsheet sheet;
+    const int columns = 100, rows = 10000, copies = 10000;
+    for (int col = 1; col <= columns; col++) {
+        for (int row = 1; row <= rows; row++) {
+            sheet.setCell(CPos(col, row), std::to_string(row));
+        }
+    }
+    sheet.setCell(CPos(1, 1), "=B2+$C$3");
+    benchmark("3x3 copyRect in a 1M cell sheet", copies, "copies", [&]() {
+        for (int i = 0; i < copies; i++) {
+            sheet.copyRect(CPos(i % 97 + 1, i % rows + 1), CPos(1, 1), 3, 3);
+        }
+    });
+}
+
+// Sums a dense column and a mostly empty sheet-sized range, the empty tiles are never visited
+void benchRangeSum() {
+    CellStore array;
+    TemplatePool templates;
+    NodeArena scratch;
+    const int rows = 1000000, rounds = 100;
+    for (int row = 1; row <= rows; row++) {
+        array.put(CPos(1, row), std::make_unique<cellContents>(std::to_string(row % 1000), CPos(1, row), templates,
+                                                               scratch));
+    }
+    for (int i = 0; i < 1000; i++) {
+        CPos pos(3 + i * 16, 1 + i * 1000);
+        array.put(pos, std::make_unique<cellContents>(std::to_string(i), pos, templates, scratch));
+    }
+    cellContents dense("=SUM(A1:A1000000)", CPos(2, 1), templates, scratch);
+    cellContents sparse("=SUM(C1:XFD1048576)", CPos(2, 2), templates, scratch);
+    double sum = 0;
+    benchmark("SUM over a dense column", double(rows) * rounds, "cells", [&]() {
+        for (int round = 0; round < rounds; round++) sum += std::get<double>(dense.formula->code.run({array, dense.pos}));
+    });
+    benchmark("SUM over a sparse sheet-sized range", 1000.0 * rounds, "cells", [&]() {
+        for (int round = 0; round < rounds; round++) sum += std::get<double>(sparse.formula->code.run({array, sparse.pos}));
+    });
+    if (sum == 0) std::cout << "unexpected sum" << std::endl;
+}
+
+// Running totals down a long column, each SUM is answered from the column index
+void benchRunningTotals() {
+    CSpreadsheet sheet;
+    const int rows = 100000;
+    for (int row = 1; row <= rows; row++) {
+        sheet.setCell(CPos(1, row), std::to_string(row % 100));
+    }
+    sheet.setCell(CPos(2, 1), "=SUM($A$1:A1)");
+    for (int filled = 1; filled < rows; filled *= 2) {
+        sheet.copyRect(CPos(2, filled + 1), CPos(2, 1), 1, std::min(filled, rows - filled));
+    }
+    benchmark("running totals recalculate", rows, "cells", [&]() { sheet.recalculate(1); });
+    benchmark("running totals edit and recalculate", rows, "cells", [&]() {
+        sheet.setCell(CPos(1, 1), "5");
+        sheet.recalculate(1);
+    });
+    // Only the last total reads the last row, the ranges of the others are never tested
+    benchmark("running totals edit of the last row", 1, "edits", [&]() {
+        sheet.setCell(CPos(1, rows), "7");
+        sheet.getValue(CPos(2, rows));
+    });
+}
+
+// Running totals of rows that also look themselves up in the whole table, so an edit near the top
+// reaches every row through many ranges. update walks each range as one node.
+void benchRangeDependents() {
+    CSpreadsheet sheet;
+    const int rows = 3000;
+    std::string table = "$A$1:$B$" + std::to_string(rows);
+    // Column by column, so no cell has readers yet when it is set
+    for (int col = 1; col <= 4; col++) {
+        for (int row = 1; row <= rows; row++) {
+            std::string r = std::to_string(row);
+            if (col == 1) sheet.setCell(CPos(col, row), r);
+            else if (col == 2) sheet.setCell(CPos(col, row), "=SUM($A$1:A" + r + ")");
+            else if (col == 3) sheet.setCell(CPos(col, row), "=B" + r + "+VLOOKUP(" + r + ", " + table + ", 2, 0)");
+            else sheet.setCell(CPos(col, row), row == 1 ? "=C1" : "=D" + std::to_string(row - 1) + "+C" + r);
+        }
+    }
+    sheet.getValue(CPos(4, rows));
+    benchmark("edit under ranges read by every row", 1, "edits", [&]() { sheet.setCell(CPos(1, 10), "7"); });
+    benchmark("value after that edit", 1, "reads", [&]() { sheet.getValue(CPos(4, rows)); });
+}
+
+// Looks keys up in a 100k row table, every lookup goes through the column indexes
+void benchLookups() {
+    CSpreadsheet sheet;
+    const int rows = 100000, lookups = 10000;
+    for (int row = 1; row <= rows; row++) {
+        sheet.setCell(CPos(1, row), std::to_string(row * 2));
+        sheet.setCell(CPos(2, row), "item" + std::to_string(row));
+    }
+    for (int i = 1; i <= lookups; i++) {
+        std::string key = std::to_string(i * 7 % rows);
+        sheet.setCell(CPos(4, i), "=VLOOKUP(" + key + ", $A$1:$B$100000, 2, 0)");
+        sheet.setCell(CPos(5, i), "=MATCH(" + key + ", $A$1:$A$100000)");
+        sheet.setCell(CPos(6, i), "=XLOOKUP(\"item" + key + "\", $B$1:$B$100000, $A$1:$A$100000)");
+    }
+    benchmark("lookups in a 100k row table", lookups * 3.0, "lookups", [&]() { sheet.recalculate(1); });
+}
+
+// Nearest matches inside windows of a column of formulas, read from the store without a sheet
+// around it. Each formula joins the lookup index once instead of being evaluated by every lookup.
+void benchFormulaLookups() {
+    CellStore array;
+    TemplatePool templates;
+    NodeArena scratch;
+    const int rows = 100000, lookups = 100000, window = 10000;
+    for (int row = 1; row <= rows; row++) {
+        array.put(CPos(2, row), std::make_unique<cellContents>(std::to_string(row), CPos(2, row), templates, scratch));
+        array.put(CPos(1, row), std::make_unique<cellContents>("=2*B" + std::to_string(row), CPos(1, row), templates,
+                                                               scratch));
+    }
+    int wrong = 0;
+    auto run = [&]() {
+        for (int i = 0; i < lookups; i++) {
+            int from = 1 + int(i * 7919LL % (rows - window));
+            auto row = array.lookup(1, from, from + window, CValue(from * 2.0 + window - 1), Match::Below, false);
+            if (row != from + window / 2 - 1) wrong++;
+        }
+    };
+    benchmark("nearest lookups in windows of formulas", lookups, "lookups", run);
+    array.invalidate(CPos(1, rows / 2));
+    benchmark("the same after one formula turns dirty", lookups, "lookups", run);
+    if (wrong) std::cout << "lookup result mismatch" << std::endl;
+}
+
+// Conditional aggregates over a 1M row column, numbers are matched a run at a time
+void benchConditional() {
+    CSpreadsheet sheet;
+    const int rows = 1000000;
+    for (int row = 1; row <= rows; row++) {
+        sheet.setCell(CPos(1, row), std::to_string(row % 1000));
+        if (row % 10 == 0) sheet.setCell(CPos(2, row), "tag" + std::to_string(row % 7));
+    }
+    sheet.setCell(CPos(4, 1), "=COUNTIF($A$1:$A$1000000, \">500\")");
+    sheet.setCell(CPos(4, 2), "=SUMIF($A$1:$A$1000000, \"<>7\")");
+    sheet.setCell(CPos(4, 3), "=AVERAGEIF($A$1:$A$1000000, \"<=250\")");
+    sheet.setCell(CPos(4, 4), "=COUNTIF($B$1:$B$1000000, \"tag3\")");
+    benchmark("COUNTIF/SUMIF/AVERAGEIF over 1M rows", rows * 4.0, "cells", [&]() { sheet.recalculate(1); });
+}
+
+// Loads a saved sheet of 1M cells: numbers, strings and filled-down formulas
+void benchLoad() {
+    CSpreadsheet sheet;
+    const int rows = 250000;
+    for (int row = 1; row <= rows; row++) {
+        sheet.setCell(CPos(1, row), std::to_string(row * 0.5));
+        sheet.setCell(CPos(2, row), "label number " + std::to_string(row));
+    }
+    sheet.setCell(CPos(3, 1), "=A1*2+B1");
+    sheet.setCell(CPos(4, 1), "=SUM($A$1:A1)-C1");
+    for (int filled = 1; filled < rows; filled *= 2) {
+        sheet.copyRect(CPos(3, filled + 1), CPos(3, 1), 2, std::min(filled, rows - filled));
+    }
+    std::ostringstream saved;
+    sheet.save(saved);
+    std::string data = saved.str();
+    benchmark("save of " + std::to_string(data.size() >> 20) + " MB", data.size(), "B", [&]() {
+        std::ostringstream os;
+        sheet.save(os);
+    });
+    std::ostringstream compacted;
+    sheet.compact(compacted);
+    sheet.setCell(CPos(1, 10), "1");
+    sheet.setCell(CPos(2, 20), "edited");
+    sheet.setCell(CPos(3, 30), "=A30+1");
+    benchmark("journal of 3 edits to the same sheet", 3, "edits", [&]() {
+        std::ostringstream journal;
+        sheet.saveChanges(journal);
+    });
+    for (unsigned threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+        CSpreadsheet loaded;
+        benchmark("load of " + std::to_string(data.size() >> 20) + " MB on " + std::to_string(threads) + " threads",
+                  data.size(), "B", [&]() {
+                    std::istringstream is(data);
+                    if (!loaded.load(is, false, threads)) std::cout << "load failed" << std::endl;
+                });
+    }
+    CSpreadsheet lazy;
+    benchmark("lazy load of " + std::to_string(data.size() >> 20) + " MB and one value", data.size(), "B", [&]() {
+        std::istringstream is(data);
+        if (!lazy.load(is, true)) std::cout << "load failed" << std::endl;
+        lazy.getValue(CPos(3, rows));
+    });
+    std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.snapshot").string();
+    {
+        std::ofstream file(path, std::ios::binary);
+        sheet.saveSnapshot(file);
+    }
+    double size = std::filesystem::file_size(path);
+    CSpreadsheet whole, region;
+    benchmark("snapshot load of " + std::to_string(int(size) >> 20) + " MB", size, "B", [&]() {
+        if (!whole.loadSnapshot(path)) std::cout << "snapshot load failed" << std::endl;
+    });
+    benchmark("snapshot load of a 1000 row region", 4 * 1000, "cells", [&]() {
+        if (!region.loadSnapshot(path, CPos(1, 100000), CPos(4, 100999))) std::cout << "snapshot load failed" << std::endl;
+    });
+    std::filesystem::remove(path);
+}
+
+// Fills 100k rows of numbers and two dependent formulas cell by cell, as one setCells call and inside a batch
+void benchBatch() {
+    const int rows = 100000;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 1; row <= rows; row++) {
+        std::string r = std::to_string(row);
+        cells.emplace_back(CPos(1, row), r);
+        cells.emplace_back(CPos(2, row), "=A" + r + "*2");
+        cells.emplace_back(CPos(3, row), "=B" + r + "+A" + r);
+    }
+    CSpreadsheet single, bulk, batched;
+    benchmark("setCell of " + std::to_string(cells.size()) + " cells", cells.size(), "cells", [&]() {
+        for (auto &[pos, contents]: cells) single.setCell(pos, contents);
+    });
+    benchmark("setCells of " + std::to_string(cells.size()) + " cells", cells.size(), "cells", [&]() {
+        bulk.setCells(cells);
+    });
+    benchmark("batch of " + std::to_string(cells.size()) + " setCell calls", cells.size(), "cells", [&]() {
+        batched.beginBatch();
+        for (auto &[pos, contents]: cells) batched.setCell(pos, contents);
+        batched.commit();
+    });
+}
+
+// Reads every value of a recalculated 100k row sheet from several threads at once
+void benchConcurrentReads() {
+    CSpreadsheet sheet;
+    const int rows = 100000;
+    for (int row = 1; row <= rows; row++) {
+        sheet.setCell(CPos(1, row), std::to_string(row));
+    }
+    sheet.setCell(CPos(2, 1), "=A1*2+1");
+    for (int filled = 1; filled < rows; filled *= 2) {
+        sheet.copyRect(CPos(2, filled + 1), CPos(2, 1), 1, std::min(filled, rows - filled));
+    }
+    sheet.recalculate();
+    for (unsigned threads = 1; threads <= 4 * std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+        benchmark("getValue from " + std::to_string(threads) + " threads", 2.0 * rows * threads, "reads", [&]() {
+            std::vector<std::thread> readers;
+            for (unsigned t = 0; t < threads; t++) {
+                readers.emplace_back([&]() {
+                    const CSpreadsheet &view = sheet;
+                    for (int row = 1; row <= rows; row++) {
+                        view.getValue(CPos(1, row));
+                        view.getValue(CPos(2, row));
+                    }
+                });
+            }
+            for (auto &reader: readers) reader.join();
+        });
+    }
+}
+
+// Copies a sheet of 1M cells, then edits the copy, which clones only the tiles the edit reaches
+void benchCopies() {
+    CSpreadsheet sheet;
+    const int rows = 250000;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 1; row <= rows; row++) {
+        std::string r = std::to_string(row);
+        cells.emplace_back(CPos(1, row), r);
+        cells.emplace_back(CPos(2, row), "label " + r);
+        cells.emplace_back(CPos(3, row), "=A" + r + "*2");
+        cells.emplace_back(CPos(4, row), "=C" + r + "+A" + r);
+    }
+    sheet.setCells(cells);
+    sheet.recalculate();
+    std::vector<CSpreadsheet> copies;
+    copies.reserve(100);
+    benchmark("100 copies of a 1M cell sheet", 100, "copies", [&]() {
+        for (int i = 0; i < 100; i++) copies.push_back(sheet);
+    });
+    benchmark("one edit in each copy", 100, "edits", [&]() {
+        for (int i = 0; i < 100; i++) {
+            copies[i].setCell(CPos(1, i * 1000 + 1), "0");
+            copies[i].getValue(CPos(4, i * 1000 + 1));
+        }
+    });
+}
+
+// Fills 1M cells from 16 category labels, then compares and joins them in 100k formulas
+void benchLabels() {
+    CSpreadsheet sheet;
+    const int rows = 500000;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 1; row <= rows; row++) {
+        cells.emplace_back(CPos(1, row), "category number " + std::to_string(row % 16));
+        cells.emplace_back(CPos(2, row), "category number " + std::to_string(row % 15));
+    }
+    benchmark("setCells of 1M labels", cells.size(), "cells", [&]() { sheet.setCells(cells); });
+    for (int row = 1; row <= 100000; row++) {
+        std::string r = std::to_string(row);
+        sheet.setCell(CPos(3, row), "=A" + r + "=B" + r);
+        sheet.setCell(CPos(4, row), "=A" + r + "+B" + r);
+    }
+    benchmark("label comparisons and joins", 200000, "formulas", [&]() { sheet.recalculate(1); });
+}
+
+void benchRepeats() {
+    CSpreadsheet sheet;
+    const int rows = 200000;
+    for (int row = 1; row <= rows; row++) {
+        std::string r = std::to_string(row);
+        sheet.setCell(CPos(1, row), std::to_string(row % 100));
+        sheet.setCell(CPos(2, row), std::to_string(row % 7));
+        // Constant parts and a subexpression used three times
+        sheet.setCell(CPos(3, row), "=(A" + r + "*B" + r + "+2^10)*(A" + r + "*B" + r + "+2^10)/(A" + r + "*B" + r +
+                                    "+2^10)*(60*60*24)/86400*1");
+    }
+    benchmark("formulas with constants and repeats", rows, "formulas", [&]() { sheet.recalculate(1); });
+}
+
+void benchColumnRuns() {
+    CSpreadsheet sheet;
+    const int rows = 1000000;
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (int row = 1; row <= rows; row++) {
+        cells.emplace_back(CPos(1, row), std::to_string(row % 1000));
+        cells.emplace_back(CPos(2, row), std::to_string(row % 7 + 1));
+        cells.emplace_back(CPos(3, row), std::to_string(row % 13));
+    }
+    sheet.setCells(cells);
+    sheet.setCell(CPos(4, 1), "=A1*B1+C1");
+    for (int filled = 1; filled < rows; filled *= 2) {
+        sheet.copyRect(CPos(4, filled + 1), CPos(4, 1), 1, std::min(filled, rows - filled));
+    }
+    benchmark("recalculate 1M filled-down formulas", rows, "formulas", [&]() { sheet.recalculate(1); });
+}
+
+int runBenchmarks() {
+    benchFormulaEval(true);
+    benchFormulaEval(false);
+    benchFillDown();
+    benchSmallCopies();
+    benchRangeSum();
+    benchRunningTotals();
+    benchRangeDependents();
+    benchLookups();
+    benchFormulaLookups();
+    benchConditional();
+    benchLoad();
+    benchBatch();
+    benchConcurrentReads();
+    benchCopies();
+    benchLabels();
+    benchRepeats();
+    benchColumnRuns();
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && argv[1] == "bench"sv) return runBenchmarks();
+
     CSpreadsheet x0, x1;
     std::ostringstream oss;
     std::istringstream iss;
@@ -1407,6 +6114,633 @@ int main() {
     assert (valueMatch(x0.getValue(CPos("H12")), CValue(25.0)));
     assert (valueMatch(x0.getValue(CPos("H13")), CValue(-22.0)));
     assert (valueMatch(x0.getValue(CPos("H14")), CValue(-22.0)));
+    CSpreadsheet x2;
+    assert (x2.setCell(CPos("C1"), "1"));
+    for (int i = 2; i <= 40; i++) {
+        std::string prev = "C" + std::to_string(i - 1);
+        assert (x2.setCell(CPos("C" + std::to_string(i)), "=" + prev + "+" + prev));
+    }
+    assert (valueMatch(x2.getValue(CPos("C40")), CValue(549755813888.0)));
+    assert (x2.setCell(CPos("C1"), "2"));
+    assert (valueMatch(x2.getValue(CPos("C40")), CValue(1099511627776.0)));
+    assert (x2.setCell(CPos("C20"), "=5"));
+    assert (valueMatch(x2.getValue(CPos("C19")), CValue(524288.0)));
+    assert (valueMatch(x2.getValue(CPos("C40")), CValue(5242880.0)));
+    x2.copyRect(CPos("C20"), CPos("C25"));
+    assert (valueMatch(x2.getValue(CPos("C40")), CValue(1099511627776.0)));
+    assert (x2.setCell(CPos("E1"), "=E2+1"));
+    assert (x2.setCell(CPos("E2"), "=E1+1"));
+    assert (x2.setCell(CPos("E3"), "=E2*2"));
+    assert (x2.setCell(CPos("E4"), "=E4"));
+    assert (valueMatch(x2.getValue(CPos("E1")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("E3")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("E4")), CValue()));
+    assert (x2.setCell(CPos("E2"), "5"));
+    assert (valueMatch(x2.getValue(CPos("E1")), CValue(6.0)));
+    assert (valueMatch(x2.getValue(CPos("E3")), CValue(10.0)));
+    x2.copyRect(CPos("E2"), CPos("E1"));
+    assert (valueMatch(x2.getValue(CPos("E2")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("E3")), CValue()));
+    assert (x2.setCell(CPos("F1"), "1"));
+    for (int i = 2; i <= 20000; i++) {
+        assert (x2.setCell(CPos("F" + std::to_string(i)), "=F" + std::to_string(i - 1) + "+1"));
+    }
+    assert (valueMatch(x2.getValue(CPos("F20000")), CValue(20000.0)));
+    assert (x2.setCell(CPos("F1"), "=F20000"));
+    assert (valueMatch(x2.getValue(CPos("F20000")), CValue()));
+    assert (x2.setCell(CPos("F1"), "-1"));
+    assert (valueMatch(x2.getValue(CPos("F20000")), CValue(19998.0)));
+    assert (x2.setCell(CPos("F1"), "1"));
+    for (int i = 1; i <= 200; i++) {
+        std::string row = std::to_string(i);
+        assert (x2.setCell(CPos("G" + row), "=F" + row + "*2"));
+        assert (x2.setCell(CPos("H" + row), "=G" + row + "+F" + row + "+$G$1"));
+    }
+    x2.recalculate(4);
+    assert (valueMatch(x2.getValue(CPos("H200")), CValue(602.0)));
+    assert (valueMatch(x2.getValue(CPos("E2")), CValue()));
+    assert (x2.setCell(CPos("F1"), "2"));
+    x2.recalculate(3);
+    assert (valueMatch(x2.getValue(CPos("H1")), CValue(10.0)));
+    assert (valueMatch(x2.getValue(CPos("H200")), CValue(607.0)));
+    assert (x2.setCell(CPos("I1"), "=\"ab\"+\"cd\""));
+    assert (x2.setCell(CPos("I2"), "=I1+1"));
+    assert (x2.setCell(CPos("I3"), "=(I1<\"b\")+(I1>=I2)*2+(I1<>I2)*4"));
+    assert (x2.setCell(CPos("I4"), "=I1-1"));
+    assert (x2.setCell(CPos("I5"), "=1/(I3-5)"));
+    assert (x2.setCell(CPos("I6"), "=-I1"));
+    assert (x2.setCell(CPos("I7"), "=(I1=1)+2"));
+    assert (valueMatch(x2.getValue(CPos("I1")), CValue("abcd")));
+    assert (valueMatch(x2.getValue(CPos("I2")), CValue("abcd1.000000")));
+    assert (valueMatch(x2.getValue(CPos("I3")), CValue(5.0)));
+    assert (valueMatch(x2.getValue(CPos("I4")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("I5")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("I6")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("I7")), CValue()));
+    CSpreadsheet x3, x4;
+    for (int i = 1; i <= 1000; i++) {
+        assert (x3.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+    }
+    assert (x3.setCell(CPos("B1"), "=A1*2+$A$1"));
+    for (int i = 1; i < 1000; i *= 2) {
+        x3.copyRect(CPos("B" + std::to_string(i + 1)), CPos("B1"), 1, std::min(i, 1000 - i));
+    }
+    x3.copyRect(CPos("C1"), CPos("B1"), 1, 1000);
+    assert (valueMatch(x3.getValue(CPos("B1000")), CValue(2001.0)));
+    assert (valueMatch(x3.getValue(CPos("C10")), CValue(43.0)));
+    oss.clear();
+    oss.str("");
+    assert (x3.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x4.load(iss));
+    assert (valueMatch(x4.getValue(CPos("B500")), CValue(1001.0)));
+    assert (valueMatch(x4.getValue(CPos("C500")), CValue(2003.0)));
+    assert (x4.setCell(CPos("A1"), "0"));
+    assert (valueMatch(x4.getValue(CPos("C500")), CValue(2000.0)));
+    assert (valueMatch(x3.getValue(CPos("C500")), CValue(2003.0)));
+    std::string big(3 << 20, 'x');
+    iss.clear();
+    iss.str(" (A1;5;a);b))  (B2;5;=C2+1)(C2;3;=B2)(E1;" + std::to_string(big.size()) + ";" + big + ")");
+    assert (x4.load(iss));
+    assert (valueMatch(x4.getValue(CPos("A1")), CValue("a);b)")));
+    assert (valueMatch(x4.getValue(CPos("B2")), CValue()));
+    assert (valueMatch(x4.getValue(CPos("E1")), CValue(big)));
+    assert (x4.setCell(CPos("C2"), "4"));
+    assert (valueMatch(x4.getValue(CPos("B2")), CValue(5.0)));
+    iss.clear();
+    iss.str("(A1;2;10)(B1;5;=A1");
+    assert (!x4.load(iss));
+    assert (valueMatch(x4.getValue(CPos("A1")), CValue(10.0)));
+    iss.clear();
+    iss.str("(A1;-2;10)");
+    assert (!x4.load(iss));
+    CSpreadsheet x5;
+    assert (x5.setCell(CPos("BK63"), "1"));
+    assert (x5.setCell(CPos("BL63"), "2"));
+    assert (x5.setCell(CPos("BK64"), "4"));
+    assert (x5.setCell(CPos("BL64"), "=BK63+BL63+BK64"));
+    assert (x5.setCell(CPos(-70, -3), "8"));
+    assert (valueMatch(x5.getValue(CPos("BL64")), CValue(7.0)));
+    assert (valueMatch(x5.getValue(CPos(-70, -3)), CValue(8.0)));
+    assert (valueMatch(x5.getValue(CPos(-70, -4)), CValue()));
+    x5.copyRect(CPos("BK1"), CPos("BK63"), 2, 2);
+    x5.copyRect(CPos("BK63"), CPos("A1"), 2, 2);
+    assert (valueMatch(x5.getValue(CPos("BL2")), CValue(7.0)));
+    assert (valueMatch(x5.getValue(CPos("BL64")), CValue()));
+    x5.copyRect(CPos("BL1"), CPos("BK1"), 2, 2);
+    assert (valueMatch(x5.getValue(CPos("BL1")), CValue(1.0)));
+    assert (valueMatch(x5.getValue(CPos("BM2")), CValue(7.0)));
+    assert (valueMatch(x5.getValue(CPos("BL2")), CValue(4.0)));
+    CSpreadsheet x6;
+    for (int i = 1; i <= 200; i++) {
+        assert (x6.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+    }
+    assert (x6.setCell(CPos("A50"), "text"));
+    assert (x6.setCell(CPos("A60"), "=A1*1000"));
+    assert (x6.setCell(CPos("B1"), "=SUM(A1:A200)"));
+    assert (x6.setCell(CPos("B2"), "=count(A200:A1)"));
+    assert (x6.setCell(CPos("B3"), "=min(A2:A200) + Max(A1:A200)"));
+    assert (x6.setCell(CPos("B4"), "=AVG(A1:A4, 10)"));
+    assert (x6.setCell(CPos("B5"), "=countval(1000, $A$1:$A$1000000)"));
+    assert (x6.setCell(CPos("B6"), "=if(B5, \"yes\", \"no\")"));
+    assert (x6.setCell(CPos("B7"), "=sum(C1:ZZ100000)"));
+    assert (x6.setCell(CPos("B8"), "=SUM(A1:A3) - 2 ^ 2 * -1"));
+    assert (!x6.setCell(CPos("B9"), "=A1:A3"));
+    assert (!x6.setCell(CPos("B9"), "=SUM(A1:A3) + A1:A2"));
+    assert (!x6.setCell(CPos("B9"), "=IF(A1:A3, 1, 2)"));
+    assert (!x6.setCell(CPos("B9"), "=NOPE(A1)"));
+    assert (!x6.setCell(CPos("B9"), "=SUM(A1"));
+    assert (valueMatch(x6.getValue(CPos("B1")), CValue(20100.0 - 50 - 60 + 1000)));
+    assert (valueMatch(x6.getValue(CPos("B2")), CValue(200.0)));
+    assert (valueMatch(x6.getValue(CPos("B3")), CValue(1002.0)));
+    assert (valueMatch(x6.getValue(CPos("B4")), CValue(4.0)));
+    assert (valueMatch(x6.getValue(CPos("B5")), CValue(1.0)));
+    assert (valueMatch(x6.getValue(CPos("B6")), CValue("yes")));
+    assert (valueMatch(x6.getValue(CPos("B7")), CValue()));
+    assert (valueMatch(x6.getValue(CPos("B8")), CValue(10.0)));
+    assert (x6.setCell(CPos("A1"), "2"));
+    x6.recalculate(2);
+    assert (valueMatch(x6.getValue(CPos("B1")), CValue(20100.0 - 50 - 60 + 2001)));
+    assert (valueMatch(x6.getValue(CPos("B5")), CValue(0.0)));
+    assert (valueMatch(x6.getValue(CPos("B6")), CValue("no")));
+    assert (x6.setCell(CPos("A100"), "=B1"));
+    assert (valueMatch(x6.getValue(CPos("B1")), CValue()));
+    assert (valueMatch(x6.getValue(CPos("B6")), CValue()));
+    assert (valueMatch(x6.getValue(CPos("B4")), CValue(4.2)));
+    assert (x6.setCell(CPos("A100"), "100"));
+    assert (valueMatch(x6.getValue(CPos("B6")), CValue("no")));
+    x6.copyRect(CPos("C2"), CPos("B2"), 1, 1);
+    assert (valueMatch(x6.getValue(CPos("C2")), CValue()));
+    assert (valueMatch(x6.getValue(CPos("B7")), CValue()));
+    assert (x6.setCell(CPos("B7"), "=1"));
+    assert (valueMatch(x6.getValue(CPos("C2")), CValue(8.0)));
+    CSpreadsheet x7;
+    for (int i = 1; i <= 5000; i++) {
+        assert (x7.setCell(CPos("A" + std::to_string(i)), std::to_string(i % 100)));
+    }
+    assert (x7.setCell(CPos("B1"), "=SUM($A$1:A1)"));
+    for (int i = 1; i < 5000; i *= 2) {
+        x7.copyRect(CPos("B" + std::to_string(i + 1)), CPos("B1"), 1, std::min(i, 5000 - i));
+    }
+    assert (x7.setCell(CPos("C1"), "=MIN(A2:A4999) + MAX(A70:A4000) * 1000 + COUNT(A1:B5000) * 1000000"));
+    assert (x7.setCell(CPos("A4321"), "=-7"));
+    x7.recalculate(4);
+    assert (valueMatch(x7.getValue(CPos("B5000")), CValue(50 * 99.0 * 50 - 21 - 7)));
+    assert (valueMatch(x7.getValue(CPos("B4320")), CValue(50 * 99.0 * 43 + 210)));
+    assert (valueMatch(x7.getValue(CPos("C1")), CValue(-7 + 99000 + 10000000000.0)));
+    assert (x7.setCell(CPos("A100"), "1000"));
+    assert (x7.setCell(CPos("A4321"), "hello"));
+    assert (valueMatch(x7.getValue(CPos("B5000")), CValue(50 * 99.0 * 50 - 21 + 1000)));
+    assert (valueMatch(x7.getValue(CPos("C1")), CValue(1000000 + 10000000000.0)));
+    CSpreadsheet x8;
+    for (int i = 1; i <= 3000; i++) {
+        assert (x8.setCell(CPos("A" + std::to_string(i)), std::to_string(i * 10)));
+        assert (x8.setCell(CPos("B" + std::to_string(i)), "name" + std::to_string(i)));
+    }
+    assert (x8.setCell(CPos("A2000"), "=A1999+5"));
+    assert (x8.setCell(CPos("D1"), "=VLOOKUP(250, A1:B3000, 2, 0)"));
+    assert (x8.setCell(CPos("D2"), "=VLOOKUP(257, $A$1:$B$3000, 2)"));
+    assert (x8.setCell(CPos("D3"), "=MATCH(\"name42\", B1:B3000, 0)"));
+    assert (x8.setCell(CPos("D4"), "=MATCH(19995, A1:A3000)"));
+    assert (x8.setCell(CPos("D5"), "=XLOOKUP(\"name7\", B1:B3000, A1:A3000)"));
+    assert (x8.setCell(CPos("D6"), "=XLOOKUP(251, A1:A3000, B1:B3000, \"none\")"));
+    assert (x8.setCell(CPos("D7"), "=XLOOKUP(251, A1:A3000, B1:B3000, \"none\", 1)"));
+    assert (x8.setCell(CPos("D8"), "=MATCH(3, A1:A3000, -1) + VLOOKUP(1, A1:B3000, 5)"));
+    assert (x8.setCell(CPos("D9"), "=MATCH(20, F1:Z1, 0)"));
+    assert (x8.setCell(CPos("H1"), "20"));
+    assert (!x8.setCell(CPos("D10"), "=VLOOKUP(1, 2, 3)"));
+    assert (!x8.setCell(CPos("D10"), "=MATCH(A1:A2, A1:A2)"));
+    assert (valueMatch(x8.getValue(CPos("D1")), CValue("name25")));
+    assert (valueMatch(x8.getValue(CPos("D2")), CValue("name25")));
+    assert (valueMatch(x8.getValue(CPos("D3")), CValue(42.0)));
+    assert (valueMatch(x8.getValue(CPos("D4")), CValue(2000.0)));
+    assert (valueMatch(x8.getValue(CPos("D5")), CValue(70.0)));
+    assert (valueMatch(x8.getValue(CPos("D6")), CValue("none")));
+    assert (valueMatch(x8.getValue(CPos("D7")), CValue("name26")));
+    assert (valueMatch(x8.getValue(CPos("D8")), CValue()));
+    assert (valueMatch(x8.getValue(CPos("D9")), CValue(3.0)));
+    assert (x8.setCell(CPos("A25"), "0"));
+    assert (x8.setCell(CPos("A30"), "250"));
+    assert (x8.setCell(CPos("B1999"), "name42"));
+    x8.recalculate(4);
+    assert (valueMatch(x8.getValue(CPos("D1")), CValue("name30")));
+    assert (valueMatch(x8.getValue(CPos("D3")), CValue(42.0)));
+    assert (valueMatch(x8.getValue(CPos("D4")), CValue(2000.0)));
+    assert (x8.setCell(CPos("B42"), "renamed"));
+    assert (valueMatch(x8.getValue(CPos("D3")), CValue(1999.0)));
+    assert (x8.setCell(CPos("A1999"), "0"));
+    assert (valueMatch(x8.getValue(CPos("D4")), CValue(1998.0)));
+    // Nearer values outside the rows of the range do not count
+    assert (x8.setCell(CPos("D11"), "=VLOOKUP(19999, A100:B200, 2)"));
+    assert (x8.setCell(CPos("D12"), "=XLOOKUP(1005, A100:A200, B100:B200, \"none\", 1)"));
+    assert (valueMatch(x8.getValue(CPos("D11")), CValue("name200")));
+    assert (valueMatch(x8.getValue(CPos("D12")), CValue("name101")));
+    // A formula the index has read already changes its value
+    assert (x8.setCell(CPos("D13"), "=MATCH(30010, A1:A3000, 0)"));
+    assert (valueMatch(x8.getValue(CPos("D13")), CValue()));
+    assert (x8.setCell(CPos("A1999"), "30005"));
+    assert (valueMatch(x8.getValue(CPos("D13")), CValue(2000.0)));
+
+    CSpreadsheet x9;
+    for (int i = 1; i <= 100; i++) {
+        assert (x9.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+        assert (x9.setCell(CPos("B" + std::to_string(i)), std::to_string(i * 2)));
+    }
+    assert (x9.setCell(CPos("A101"), "x"));
+    assert (x9.setCell(CPos("D1"), "=COUNTIF(A1:A200, \">50\")"));
+    assert (x9.setCell(CPos("D2"), "=countif(A1:A200, 7) + COUNTIF(A1:A200, \"x\") + COUNTIF(A1:A200, \"<>y\")"));
+    assert (x9.setCell(CPos("D3"), "=SUMIF(A1:A200, \"<=10\")"));
+    assert (x9.setCell(CPos("D4"), "=SUMIF(A1:A200, \">90\", B1:B200)"));
+    assert (x9.setCell(CPos("D5"), "=AVERAGEIF(A1:A200, \">=99\")"));
+    assert (x9.setCell(CPos("D6"), "=AVERAGEIF(A1:A200, \">1000\")"));
+    assert (x9.setCell(CPos("D7"), "=COUNTIF(A1:A200, D8)"));
+    assert (x9.setCell(CPos("D8"), "<3"));
+    assert (!x9.setCell(CPos("D9"), "=COUNTIF(1, 2)"));
+    assert (!x9.setCell(CPos("D9"), "=SUMIF(A1:A2, A1:A2)"));
+    assert (valueMatch(x9.getValue(CPos("D1")), CValue(50.0)));
+    assert (valueMatch(x9.getValue(CPos("D2")), CValue(3.0)));
+    assert (valueMatch(x9.getValue(CPos("D3")), CValue(55.0)));
+    assert (valueMatch(x9.getValue(CPos("D4")), CValue(1910.0)));
+    assert (valueMatch(x9.getValue(CPos("D5")), CValue(99.5)));
+    assert (valueMatch(x9.getValue(CPos("D6")), CValue()));
+    assert (valueMatch(x9.getValue(CPos("D7")), CValue(2.0)));
+    assert (x9.setCell(CPos("A5"), "=A4+100"));
+    assert (x9.setCell(CPos("A3"), "60"));
+    assert (valueMatch(x9.getValue(CPos("D1")), CValue(52.0)));
+    assert (valueMatch(x9.getValue(CPos("D3")), CValue(47.0)));
+    assert (valueMatch(x9.getValue(CPos("D7")), CValue(2.0)));
+    assert (x9.setCell(CPos("E1"), "tag") && x9.setCell(CPos("E2"), "other") && x9.setCell(CPos("E3"), "tag"));
+    assert (x9.setCell(CPos("E4"), "=\"ta\"+\"g\"") && x9.setCell(CPos("E5"), "tag") && x9.setCell(CPos("E6"), "5"));
+    assert (x9.setCell(CPos("F1"), "=COUNTIF(E1:E10, \"tag\")"));
+    assert (x9.setCell(CPos("F2"), "=COUNTIF(E1:E10, \"<>tag\") + COUNTIF(E1:E10, \"<>missing\") * 10"));
+    assert (x9.setCell(CPos("F3"), "=SUMIF(E1:E10, \"=tag\", B1:B10) + COUNTIF(E1:E10, \"missing\")"));
+    assert (valueMatch(x9.getValue(CPos("F1")), CValue(4.0)));
+    assert (valueMatch(x9.getValue(CPos("F2")), CValue(51.0)));
+    assert (valueMatch(x9.getValue(CPos("F3")), CValue(26.0)));
+
+    CSpreadsheet x10, x11;
+    for (int i = 1; i <= 200; i++) {
+        assert (x10.setCell(CPos(1, i), std::to_string(i) + "e-1"));
+        assert (x10.setCell(CPos(2, i), i % 2 ? "odd" : "even"));
+    }
+    assert (x10.setCell(CPos("A300"), "=1/3"));
+    assert (x10.setCell(CPos("C1"), "=IF(A1>0.5, \"big \"\"x\"\"\", \"small\") "));
+    assert (x10.setCell(CPos("D1"), "=SUM($A$1:A1)*2"));
+    for (int i = 1; i < 200; i *= 2) {
+        x10.copyRect(CPos(3, i + 1), CPos("C1"), 2, std::min(i, 200 - i));
+    }
+    assert (x10.setCell(CPos("E1"), "=E2"));
+    assert (x10.setCell(CPos("E2"), "=E1+1"));
+    assert (x10.setCell(CPos("BZ70"), "=0.1+A300"));
+    std::string snapshot = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+    {
+        std::ofstream file(snapshot, std::ios::binary);
+        assert (x10.saveSnapshot(file));
+    }
+    assert (x11.loadSnapshot(snapshot));
+    assert (valueMatch(x11.getValue(CPos("A7")), CValue(0.7)));
+    assert (valueMatch(x11.getValue(CPos("B8")), CValue("even")));
+    assert (valueMatch(x11.getValue(CPos("A300")), CValue(1.0 / 3)));
+    assert (valueMatch(x11.getValue(CPos("C1")), CValue("small")));
+    assert (valueMatch(x11.getValue(CPos("C200")), CValue("big \"x\"")));
+    assert (valueMatch(x11.getValue(CPos("D200")), x10.getValue(CPos("D200"))));
+    assert (valueMatch(x11.getValue(CPos("E1")), CValue()));
+    assert (valueMatch(x11.getValue(CPos("BZ70")), CValue(0.1 + 1.0 / 3)));
+    assert (x11.setCell(CPos("A1"), "100"));
+    assert (valueMatch(x11.getValue(CPos("D1")), CValue(200.0)));
+    assert (x11.loadSnapshot(snapshot, CPos("A5"), CPos("D10")));
+    assert (valueMatch(x11.getValue(CPos("A4")), CValue()));
+    assert (valueMatch(x11.getValue(CPos("B5")), CValue("odd")));
+    assert (valueMatch(x11.getValue(CPos("C10")), CValue("big \"x\"")));
+    assert (valueMatch(x11.getValue(CPos("D10")), CValue(9.0)));
+    assert (valueMatch(x11.getValue(CPos("D11")), CValue()));
+    assert (valueMatch(x11.getValue(CPos("BZ70")), CValue()));
+    {
+        // An offset that wraps around when the table behind it is added must not pass the header check
+        std::fstream file(snapshot, std::ios::binary | std::ios::in | std::ios::out);
+        SnapshotHeader header{};
+        assert (file.read(reinterpret_cast<char *>(&header), sizeof(header)));
+        assert (header.strings > 0);
+        header.stringsAt = -header.strings * sizeof(uint64_t);
+        file.seekp(0);
+        assert (file.write(reinterpret_cast<const char *>(&header), sizeof(header)));
+    }
+    assert (!x11.loadSnapshot(snapshot));
+    assert (valueMatch(x11.getValue(CPos("B5")), CValue()));
+    {
+        // Tile coordinates that overflow once shifted to a position
+        std::ofstream file(snapshot, std::ios::binary);
+        assert (x10.saveSnapshot(file));
+    }
+    {
+        std::fstream file(snapshot, std::ios::binary | std::ios::in | std::ios::out);
+        SnapshotTile tile{};
+        file.seekg(sizeof(SnapshotHeader));
+        assert (file.read(reinterpret_cast<char *>(&tile), sizeof(tile)));
+        tile.col = std::numeric_limits<int32_t>::max();
+        file.seekp(sizeof(SnapshotHeader));
+        assert (file.write(reinterpret_cast<const char *>(&tile), sizeof(tile)));
+    }
+    assert (!x11.loadSnapshot(snapshot));
+    {
+        std::ofstream file(snapshot, std::ios::binary);
+        assert (x10.saveSnapshot(file));
+    }
+    std::filesystem::resize_file(snapshot, std::filesystem::file_size(snapshot) - 8);
+    assert (!x11.loadSnapshot(snapshot));
+    std::filesystem::remove(snapshot);
+    assert (!x11.loadSnapshot(snapshot));
+    oss.clear();
+    oss.str("");
+    assert (x10.save(oss));
+    data = oss.str();
+    iss.clear();
+    iss.str(data + "(F1;3;=1+)");
+    CSpreadsheet x12;
+    assert (!x12.load(iss, true));  // Like an eager load, the records before the bad one are kept
+    {
+        // Unparsed formulas go to the snapshot as their text
+        std::ofstream file(snapshot, std::ios::binary);
+        assert (x12.saveSnapshot(file));
+    }
+    assert (x11.loadSnapshot(snapshot));
+    assert (valueMatch(x11.getValue(CPos("D150")), x10.getValue(CPos("D150"))));
+    std::filesystem::remove(snapshot);
+    assert (valueMatch(x12.getValue(CPos("D150")), x10.getValue(CPos("D150"))));
+    assert (valueMatch(x12.getValue(CPos("E2")), CValue()));
+    assert (valueMatch(x12.getValue(CPos("F1")), CValue()));
+    CSpreadsheet x13(x12);
+    const CSpreadsheet x13const(x13);  // Parses lazily like any other copy
+    assert (valueMatch(x13const.getValue(CPos("D150")), x10.getValue(CPos("D150"))));
+    assert (x12.setCell(CPos("A1"), "5"));
+    assert (valueMatch(x12.getValue(CPos("D1")), CValue(10.0)));
+    assert (valueMatch(x12.getValue(CPos("D150")), CValue(std::get<double>(x10.getValue(CPos("D150"))) + 9.8)));
+    assert (valueMatch(x13.getValue(CPos("C200")), CValue("big \"x\"")));
+    x13.recalculate(2);
+    assert (valueMatch(x13.getValue(CPos("D200")), x10.getValue(CPos("D200"))));
+    oss.clear();
+    oss.str("");
+    assert (x13.save(oss));
+    assert (oss.str() == data);
+    oss.clear();
+    oss.str("");
+    assert (x3.save(oss));
+    data = oss.str();
+    iss.clear();
+    iss.str(data);
+    CSpreadsheet x14;
+    assert (x14.load(iss, false, 4));
+    assert (valueMatch(x14.getValue(CPos("C500")), CValue(2003.0)));
+    oss.clear();
+    oss.str("");
+    assert (x14.save(oss));
+    assert (oss.str() == data);
+    assert (x14.setCell(CPos("A1"), "1e-7"));
+    assert (x14.setCell(CPos("A2"), "123456789.123456789"));
+    assert (x14.setCell(CPos("A3"), "=A1*0.1+\"a\"\"b\""));
+    oss.clear();
+    oss.str("");
+    assert (x14.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x14.load(iss));
+    assert (std::get<double>(x14.getValue(CPos("A1"))) == 1e-7);
+    assert (std::get<double>(x14.getValue(CPos("A2"))) == 123456789.123456789);
+    assert (oss.str().find("(A3;18;=((A1*0.1)+\"a\"\"b\")) ") != std::string::npos);
+    CSpreadsheet x15, x16;
+    std::ostringstream base, journal;
+    for (int i = 1; i <= 100; i++) {
+        assert (x15.setCell(CPos(1, i), std::to_string(i)));
+    }
+    assert (x15.setCell(CPos("B1"), "=SUM(A1:A100)"));
+    assert (x15.compact(base));
+    assert (x15.saveChanges(journal) && journal.str().empty());
+    assert (x15.setCell(CPos("A1"), "1000"));
+    assert (x15.setCell(CPos("A1"), "2000"));
+    x15.copyRect(CPos("A2"), CPos("C2"), 1, 2);
+    assert (x15.saveChanges(journal));
+    assert (journal.str() == "(A1;4;2000) (A2;;) (A3;;) ");
+    assert (x15.setCell(CPos("C1"), "=B1*2"));
+    x15.copyRect(CPos("D1"), CPos("C1"), 1, 1);
+    assert (x15.saveChanges(journal));
+    iss.clear();
+    iss.str(base.str());
+    assert (x16.load(iss));
+    iss.clear();
+    iss.str(journal.str());
+    assert (x16.replay(iss));
+    assert (valueMatch(x16.getValue(CPos("B1")), CValue(7044.0)));
+    assert (valueMatch(x16.getValue(CPos("D1")), CValue(28176.0)));
+    assert (valueMatch(x16.getValue(CPos("C1")), CValue(14088.0)));
+    oss.clear();
+    oss.str("");
+    assert (x16.save(oss));
+    std::ostringstream expected;
+    assert (x15.save(expected));
+    assert (oss.str() == expected.str());
+    size_t journaled = journal.str().size();
+    assert (x16.saveChanges(journal) && journal.str().size() == journaled);
+    for (int i = 0; i < 50; i++) {
+        assert (x16.setCell(CPos("E1"), "label " + std::to_string(i)));
+        assert (x16.setCell(CPos("E2"), "=E1+\"" + std::to_string(i) + "\""));
+    }
+    CSpreadsheet x16copy(x16);
+    std::ostringstream compacted;
+    assert (x16.compact(compacted));
+    assert (valueMatch(x16.getValue(CPos("E2")), CValue("label 4949")));
+    assert (x16.setCell(CPos("E3"), "label 49") && x16.setCell(CPos("E4"), "=COUNTIF(E1:E3, \"label 49\")"));
+    assert (valueMatch(x16.getValue(CPos("E4")), CValue(2.0)));
+    assert (x16copy.setCell(CPos("E1"), "label 0"));
+    assert (valueMatch(x16copy.getValue(CPos("E2")), CValue("label 049")));
+    assert (valueMatch(x16copy.getValue(CPos("D1")), CValue(28176.0)));
+    CSpreadsheet x17;
+    std::vector<std::pair<CPos, std::string>> batch;
+    for (int i = 1; i <= 3000; i++) {
+        batch.emplace_back(CPos(1, i), std::to_string(i));
+        batch.emplace_back(CPos(2, i), "=A" + std::to_string(i) + "*2");
+    }
+    batch.emplace_back(CPos("B5"), "=C5");
+    batch.emplace_back(CPos("C5"), "=B5");
+    batch.emplace_back(CPos("D1"), "=SUM(B1:B3000)");
+    batch.emplace_back(CPos("D2"), "=1+");
+    assert (!x17.setCells(batch, 4));
+    assert (valueMatch(x17.getValue(CPos("B4")), CValue(8.0)));
+    assert (valueMatch(x17.getValue(CPos("B5")), CValue()));
+    assert (valueMatch(x17.getValue(CPos("D1")), CValue()));
+    assert (valueMatch(x17.getValue(CPos("D2")), CValue()));
+    x17.beginBatch();
+    assert (x17.setCell(CPos("C5"), "1"));
+    assert (x17.setCell(CPos("A1"), "100"));
+    x17.copyRect(CPos("E1"), CPos("D1"), 1, 1);
+    assert (valueMatch(x17.getValue(CPos("B5")), CValue(1.0)));
+    assert (x17.setCell(CPos("A2"), "200"));
+    assert (x17.setCells({{CPos("A3"), "300"}, {CPos("A4"), "400"}}));
+    assert (x17.commit());
+    assert (valueMatch(x17.getValue(CPos("B4")), CValue(800.0)));
+    assert (valueMatch(x17.getValue(CPos("D1")), CValue(9004971.0)));
+    assert (valueMatch(x17.getValue(CPos("E1")), CValue(1.0)));
+    x17.beginBatch();
+    assert (x17.setCell(CPos("A5"), "=1+"));
+    assert (x17.setCell(CPos("A6"), "6000"));
+    assert (x17.setCell(CPos("A6"), "=A5*2"));
+    CSpreadsheet x17copy(x17);
+    x17.copyRect(CPos("F6"), CPos("A6"), 1, 1);
+    assert (!x17.commit());
+    assert (valueMatch(x17.getValue(CPos("A5")), CValue(5.0)));
+    assert (valueMatch(x17.getValue(CPos("B6")), CValue(20.0)));
+    assert (valueMatch(x17.getValue(CPos("F6")), CValue()));
+    assert (valueMatch(x17copy.getValue(CPos("B6")), CValue(20.0)));
+    assert (x17.commit());
+    CSpreadsheet x18;
+    for (int row = 1; row <= 2000; row++) assert (x18.setCell(CPos(1, row), std::to_string(row)));
+    assert (x18.setCell(CPos("B1"), "=A1") && x18.setCell(CPos("B2"), "=B1+A2"));
+    for (int filled = 2; filled < 2000; filled = filled * 2 - 1) {
+        x18.copyRect(CPos(2, filled + 1), CPos(2, 2), 1, std::min(filled - 1, 2000 - filled));
+    }
+    oss.clear();
+    oss.str("");
+    assert (x18.save(oss));
+    CSpreadsheet x19;
+    iss.clear();
+    iss.str(oss.str());
+    assert (x19.load(iss, true));
+    std::atomic<bool> agreed = true;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 8; t++) {
+        readers.emplace_back([&, t]() {
+            const CSpreadsheet &sheet = t % 2 ? x18 : x19;
+            for (int i = 0; i < 2000; i++) {
+                int row = (i * 7 + t * 251) % 2000 + 1;
+                if (!valueMatch(sheet.getValue(CPos(2, row)), CValue(row * (row + 1) / 2.0))) agreed = false;
+            }
+        });
+    }
+    readers.emplace_back([&]() {
+        for (int i = 1; i <= 200; i++) x18.setCell(CPos(4, i), "=B" + std::to_string(i) + "*2");
+    });
+    for (auto &thread: readers) thread.join();
+    assert (agreed);
+    assert (valueMatch(x18.getValue(CPos("D200")), CValue(40200.0)));
+    CSpreadsheet x20;
+    for (int row = 1; row <= 100; row++) assert (x20.setCell(CPos(1, row), std::to_string(row)));
+    assert (x20.setCell(CPos("B1"), "=SUM($A$1:A1)") && x20.setCell(CPos("C1"), "=B100*2"));
+    for (int filled = 1; filled < 100; filled *= 2) {
+        x20.copyRect(CPos(2, filled + 1), CPos("B1"), 1, std::min(filled, 100 - filled));
+    }
+    assert (valueMatch(x20.getValue(CPos("C1")), CValue(10100.0)));
+    CSpreadsheet x21(x20);
+    assert (x21.setCell(CPos("A1"), "101"));
+    assert (valueMatch(x21.getValue(CPos("C1")), CValue(10300.0)));
+    assert (valueMatch(x20.getValue(CPos("C1")), CValue(10100.0)));
+    assert (x20.setCell(CPos("A100"), "0"));
+    assert (valueMatch(x20.getValue(CPos("B100")), CValue(4950.0)));
+    assert (valueMatch(x21.getValue(CPos("B100")), CValue(5150.0)));
+    for (int row = 5; row <= 100; row++) {
+        assert (x20.setCell(CPos(5, row), "=SUM(A" + std::to_string(row - 4) + ":A" + std::to_string(row) + ")"));
+    }
+    assert (valueMatch(x20.getValue(CPos("E50")), CValue(240.0)));
+    assert (valueMatch(x20.getValue(CPos("E54")), CValue(260.0)));
+    assert (x20.setCell(CPos("A50"), "1000"));
+    assert (valueMatch(x20.getValue(CPos("E49")), CValue(235.0)));
+    assert (valueMatch(x20.getValue(CPos("E50")), CValue(1190.0)));
+    assert (valueMatch(x20.getValue(CPos("E54")), CValue(1210.0)));
+    assert (valueMatch(x20.getValue(CPos("E55")), CValue(265.0)));
+    assert (x20.setCell(CPos("E52"), "=SUM(A52:A52)") && x20.setCell(CPos("A52"), "0"));
+    assert (valueMatch(x20.getValue(CPos("E52")), CValue(0.0)));
+    assert (valueMatch(x20.getValue(CPos("E53")), CValue(1153.0)));
+    assert (valueMatch(x20.getValue(CPos("B60")), CValue(1830.0 + 950 - 52)));
+    CSpreadsheet x22;
+    x22 = x21;
+    assert (x22.setCell(CPos("C1"), "=B1"));
+    assert (valueMatch(x22.getValue(CPos("C1")), CValue(101.0)));
+    assert (valueMatch(x21.getValue(CPos("C1")), CValue(10300.0)));
+    x22.copyRect(CPos("D1"), CPos("B1"), 1, 100);
+    assert (std::holds_alternative<double>(x22.getValue(CPos("D100"))));
+    assert (valueMatch(x21.getValue(CPos("D100")), CValue()));
+    CSpreadsheet x23(x19);
+    assert (x23.setCell(CPos("A2000"), "0"));
+    assert (valueMatch(x23.getValue(CPos("B2000")), CValue(1999000.0)));
+    assert (valueMatch(x19.getValue(CPos("B2000")), CValue(2001000.0)));
+    CSpreadsheet x24;
+    assert (x24.setCell(CPos("A1"), "category label") && x24.setCell(CPos("A2"), "category label"));
+    assert (x24.setCell(CPos("A3"), "other label") && x24.setCell(CPos("A4"), "7"));
+    assert (x24.setCell(CPos("B1"), "=A1=A2") && x24.setCell(CPos("B2"), "=A1<>A3"));
+    assert (x24.setCell(CPos("B3"), "=A3<A1") && x24.setCell(CPos("B4"), "=A1=\"category label\""));
+    assert (x24.setCell(CPos("C1"), "=A1+A4") && x24.setCell(CPos("C2"), "=A4+A3") && x24.setCell(CPos("C3"), "=A1+A3"));
+    assert (valueMatch(x24.getValue(CPos("B1")), CValue(1.0)) && valueMatch(x24.getValue(CPos("B2")), CValue(1.0)));
+    assert (valueMatch(x24.getValue(CPos("B3")), CValue(0.0)) && valueMatch(x24.getValue(CPos("B4")), CValue(1.0)));
+    assert (valueMatch(x24.getValue(CPos("C1")), CValue("category label7.000000")));
+    assert (valueMatch(x24.getValue(CPos("C2")), CValue("other label7.000000")));
+    assert (valueMatch(x24.getValue(CPos("C3")), CValue("category labelother label")));
+    CSpreadsheet x25(x24);
+    assert (x25.setCell(CPos("A2"), "changed"));
+    assert (valueMatch(x25.getValue(CPos("B1")), CValue(0.0)) && valueMatch(x24.getValue(CPos("B1")), CValue(1.0)));
+
+    CSpreadsheet x26, x27;
+    assert (x26.setCell(CPos("A1"), "4") && x26.setCell(CPos("A2"), "text") && x26.setCell(CPos("A3"), "=-0"));
+    assert (x26.setCell(CPos("B1"), "=(1+2)*A1") && x26.setCell(CPos("B2"), "=2-5") && x26.setCell(CPos("B3"), "=\"a\"+\"b\"+1"));
+    assert (x26.setCell(CPos("B4"), "=1/0") && x26.setCell(CPos("B5"), "=IF(1,\"x\",2)"));
+    assert (x26.setCell(CPos("B6"), "=2^(-1)*A1"));
+    assert (x26.setCell(CPos("C1"), "=A2*1") && x26.setCell(CPos("C2"), "=-(-A2)") && x26.setCell(CPos("C3"), "=A1*2*1"));
+    assert (x26.setCell(CPos("C4"), "=-(-(A1-0))") && x26.setCell(CPos("C5"), "=A3-0") && x26.setCell(CPos("C6"), "=(A3-0)+\"\""));
+    assert (x26.setCell(CPos("D1"), "=(A1+A1*2)*(A1+A1*2)-(A1+A1*2)") && x26.setCell(CPos("D2"), "=A2+A1*A1+(A2+A1*A1)"));
+    assert (valueMatch(x26.getValue(CPos("B1")), CValue(12.0)) && valueMatch(x26.getValue(CPos("B2")), CValue(-3.0)));
+    assert (valueMatch(x26.getValue(CPos("B3")), CValue("ab1.000000")) && valueMatch(x26.getValue(CPos("B4")), CValue()));
+    assert (valueMatch(x26.getValue(CPos("B5")), CValue("x")) && valueMatch(x26.getValue(CPos("B6")), CValue(2.0)));
+    assert (valueMatch(x26.getValue(CPos("C1")), CValue()) && valueMatch(x26.getValue(CPos("C2")), CValue()));
+    assert (valueMatch(x26.getValue(CPos("C3")), CValue(8.0)) && valueMatch(x26.getValue(CPos("C4")), CValue(4.0)));
+    assert (valueMatch(x26.getValue(CPos("C6")), CValue("-0.000000")));
+    assert (valueMatch(x26.getValue(CPos("D1")), CValue(132.0)));
+    assert (valueMatch(x26.getValue(CPos("D2")), CValue("text16.000000text16.000000")));
+    // Folded values are written so that they read back the same
+    oss.str("");
+    assert (x26.save(oss) && oss.str().find("(-3)") != std::string::npos);
+    iss.clear();
+    iss.str(oss.str());
+    assert (x27.load(iss));
+    assert (valueMatch(x27.getValue(CPos("B2")), CValue(-3.0)) && valueMatch(x27.getValue(CPos("B3")), CValue("ab1.000000")));
+    assert (valueMatch(x27.getValue(CPos("C6")), CValue("-0.000000")) && valueMatch(x27.getValue(CPos("D1")), CValue(132.0)));
+    assert (x26.setCell(CPos("A1"), "5") && valueMatch(x26.getValue(CPos("D1")), CValue(210.0)));
+    // Numeric formulas fall back to the generic path as soon as a string shows up
+    assert (x26.setCell(CPos("E1"), "=A1*A1+A1") && x26.setCell(CPos("E2"), "=A1+A2") && x26.setCell(CPos("E3"), "=A2+A1/0"));
+    assert (x26.setCell(CPos("E4"), "=A1/0+A2") && x26.setCell(CPos("E5"), "=A1>A2") && x26.setCell(CPos("E6"), "=Z9*2+A1"));
+    assert (valueMatch(x26.getValue(CPos("E1")), CValue(30.0)) && valueMatch(x26.getValue(CPos("E2")), CValue("text5.000000")));
+    assert (valueMatch(x26.getValue(CPos("E3")), CValue()) && valueMatch(x26.getValue(CPos("E4")), CValue()));
+    assert (valueMatch(x26.getValue(CPos("E5")), CValue()) && valueMatch(x26.getValue(CPos("E6")), CValue()));
+
+    // Filled-down runs evaluate as columns, the results match reading each cell on its own
+    CSpreadsheet x28, x29;
+    auto fill = [&](const std::function<void(CSpreadsheet &, int, const std::string &)> &cells) {
+        for (CSpreadsheet *sheet: {&x28, &x29}) {
+            for (int row = 1; row <= 300; row++) cells(*sheet, row, std::to_string(row));
+        }
+        x28.recalculate(2);
+        for (int row = 1; row <= 300; row++) {
+            for (const char *col: {"C", "E", "F", "G", "I"}) {
+                CPos pos(col + std::to_string(row));
+                assert (valueMatch(x28.getValue(pos), x29.getValue(pos)));
+            }
+        }
+    };
+    fill([](CSpreadsheet &sheet, int row, const std::string &r) {
+        if (row % 50 == 7) sheet.setCell(CPos("A" + r), "label");
+        else if (row % 50 != 9) sheet.setCell(CPos("A" + r), std::to_string(row % 11));
+        sheet.setCell(CPos("B" + r), std::to_string(row % 5));
+        sheet.setCell(CPos("C" + r), "=A" + r + "*B" + r + "+$D$1-A" + r + "/B" + r);
+        sheet.setCell(CPos("E" + r), "=C" + r + "*2+(C" + r + ">B" + r + ")");
+        sheet.setCell(CPos("F" + r), row == 1 ? "=E1" : "=F" + std::to_string(row - 1) + "+E" + r);
+        sheet.setCell(CPos("I" + r), "=E$3-C" + r);
+        sheet.setCell(CPos("D1"), "0.5");
+    });
+    assert (valueMatch(x28.getValue(CPos("C2")), CValue(3.5)) && valueMatch(x28.getValue(CPos("C5")), CValue()));
+    assert (valueMatch(x28.getValue(CPos("C7")), CValue()) && valueMatch(x28.getValue(CPos("C9")), CValue()));
+    // G150 reads G1 through H150, so the run of G cannot be one step
+    fill([](CSpreadsheet &sheet, int row, const std::string &r) {
+        sheet.setCell(CPos("G" + r), "=H" + r + "*2");
+        sheet.setCell(CPos("H" + r), row == 150 ? "=G1+1" : "=" + r);
+    });
+    assert (valueMatch(x28.getValue(CPos("G150")), CValue(6.0)));
     std::cout << "TESTS SUCCESSFUL" << std::endl;
     return EXIT_SUCCESS;
 }